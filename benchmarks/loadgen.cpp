@@ -0,0 +1,632 @@
+#include <arpa/inet.h>
+#include <fmt/format.h>
+#include <folly/String.h>
+#include <folly/json/json.h>
+#include <gflags/gflags.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "wrap/app.h"
+#include "wrap/filter.h"
+#include "wrap/middleware.h"
+#include "wrap/router.h"
+#include "wrap/static.h"
+
+DEFINE_string(scenarios, "hello,router,middleware,static", "Comma-separated example apps to drive");
+DEFINE_string(modes, "keepalive,pipeline,churn", "Comma-separated connection modes");
+DEFINE_uint64(rate, 20000, "Target request rate per second, independent of response times");
+DEFINE_uint64(connections, 64, "Number of client connections");
+DEFINE_uint64(pipeline, 8, "Maximum outstanding requests per connection in pipeline mode");
+DEFINE_uint64(threads, 2, "Number of client threads");
+DEFINE_uint64(server_threads, 2, "Number of server IO threads");
+DEFINE_double(duration, 5.0, "Measured seconds per run");
+DEFINE_double(warmup, 1.0, "Seconds to run before recording latencies");
+DEFINE_string(output, "", "Write JSON results to this file instead of stdout");
+
+using namespace wrap;
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// Log-linear histogram in the style of HdrHistogram: values below 2^sub_bits are exact and
+// larger values land in buckets with under 1% relative width.
+class Histogram {
+public:
+  void record(std::uint64_t value) {
+    ++counts_[index(value)];
+    ++total_;
+    max_ = std::max(max_, value);
+  }
+
+  void merge(Histogram const& other) {
+    for (std::size_t i = 0; i < counts_.size(); ++i) {
+      counts_[i] += other.counts_[i];
+    }
+    total_ += other.total_;
+    max_ = std::max(max_, other.max_);
+  }
+
+  std::uint64_t percentile(double p) const {
+    if (total_ == 0) {
+      return 0;
+    }
+    auto const target = std::max<std::uint64_t>(
+        1, static_cast<std::uint64_t>(std::ceil(p / 100.0 * static_cast<double>(total_)))
+    );
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < counts_.size(); ++i) {
+      seen += counts_[i];
+      if (seen >= target) {
+        return std::min(upper_bound(i), max_);
+      }
+    }
+    return max_;
+  }
+
+  std::uint64_t count() const { return total_; }
+
+  std::uint64_t max() const { return max_; }
+
+private:
+  static constexpr int sub_bits = 7;
+  static constexpr std::uint64_t sub_mask = (1u << sub_bits) - 1;
+
+  static std::size_t index(std::uint64_t v) {
+    if (v <= sub_mask) {
+      return v;
+    }
+    int const shift = 63 - std::countl_zero(v) - sub_bits;
+    return (static_cast<std::size_t>(shift + 1) << sub_bits) + ((v >> shift) & sub_mask);
+  }
+
+  static std::uint64_t upper_bound(std::size_t i) {
+    if (i <= sub_mask) {
+      return i;
+    }
+    auto const shift = (i >> sub_bits) - 1;
+    return ((sub_mask + 1 + (i & sub_mask) + 1) << shift) - 1;
+  }
+
+  std::array<std::uint64_t, (64 - sub_bits + 1) << sub_bits> counts_{};
+  std::uint64_t total_{0};
+  std::uint64_t max_{0};
+};
+
+struct Mode {
+  std::string name;
+  std::size_t depth;
+  // Requests per connection before it is closed and reopened, 0 for unlimited.
+  std::size_t per_connection;
+};
+
+struct Result {
+  Histogram latency;
+  std::uint64_t completed{0};
+  std::uint64_t errors{0};
+  std::uint64_t non_2xx{0};
+  std::uint64_t incomplete{0};
+  std::uint64_t connects{0};
+};
+
+std::uint64_t elapsed_ns(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+bool iequals(std::string_view lhs, std::string_view rhs) {
+  return std::ranges::equal(lhs, rhs, [](unsigned char a, unsigned char b) {
+    return std::tolower(a) == std::tolower(b);
+  });
+}
+
+std::string_view trim(std::string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+// Returns the size of the first complete response in `buf`, 0 if more data is needed, or -1 if
+// the response cannot be parsed.
+long parse_response(std::string_view buf, int& status) {
+  auto const end = buf.find("\r\n\r\n");
+  if (end == std::string_view::npos) {
+    return 0;
+  }
+  if (buf.size() < 12 || !buf.starts_with("HTTP/1.")) {
+    return -1;
+  }
+  std::from_chars(buf.data() + 9, buf.data() + 12, status);
+  std::size_t length = 0;
+  bool has_length = false;
+  bool chunked = false;
+  auto headers = buf.substr(0, end);
+  for (auto pos = headers.find("\r\n"); pos != std::string_view::npos;) {
+    auto next = headers.find("\r\n", pos + 2);
+    auto line = headers.substr(pos + 2, next == std::string_view::npos ? next : next - pos - 2);
+    auto colon = line.find(':');
+    if (colon != std::string_view::npos) {
+      auto name = line.substr(0, colon);
+      auto value = trim(line.substr(colon + 1));
+      if (iequals(name, "content-length")) {
+        has_length = std::from_chars(value.data(), value.data() + value.size(), length).ec ==
+                     std::errc();
+      } else if (iequals(name, "transfer-encoding")) {
+        chunked = iequals(value, "chunked");
+      }
+    }
+    pos = next;
+  }
+  std::size_t pos = end + 4;
+  if (chunked) {
+    while (true) {
+      auto line = buf.find("\r\n", pos);
+      if (line == std::string_view::npos) {
+        return 0;
+      }
+      std::size_t size = 0;
+      std::from_chars(buf.data() + pos, buf.data() + line, size, 16);
+      pos = line + 2;
+      if (size == 0) {
+        return buf.size() < pos + 2 ? 0 : static_cast<long>(pos + 2);
+      }
+      pos += size + 2;
+      if (buf.size() < pos) {
+        return 0;
+      }
+    }
+  }
+  if (has_length) {
+    pos += length;
+  }
+  return buf.size() < pos ? 0 : static_cast<long>(pos);
+}
+
+struct Connection {
+  int fd{-1};
+  bool connecting{false};
+  bool writing{false};
+  std::string out;
+  std::size_t written{0};
+  std::string in;
+  // Intended send times, in nanoseconds since the start of the run, so queueing delay caused by
+  // a slow server counts against its latency instead of silently lowering the offered load.
+  std::deque<std::uint64_t> pending;
+  std::deque<std::uint64_t> inflight;
+  std::uint64_t next_due{0};
+  std::size_t sent{0};
+};
+
+class Worker {
+public:
+  Worker(
+      std::uint16_t port, std::string request, Mode mode, std::size_t connections,
+      std::uint64_t interval_ns
+  )
+      : port_(port),
+        request_(std::move(request)),
+        mode_(std::move(mode)),
+        connections_(connections),
+        interval_ns_(interval_ns) {
+    last_request_ = request_;
+    last_request_.insert(last_request_.size() - 2, "Connection: close\r\n");
+  }
+
+  Result run(Clock::time_point start, std::uint64_t warmup_ns, std::uint64_t end_ns) {
+    epoll_ = epoll_create1(EPOLL_CLOEXEC);
+    timer_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = connections_.size();
+    epoll_ctl(epoll_, EPOLL_CTL_ADD, timer_, &ev);
+
+    for (std::size_t i = 0; i < connections_.size(); ++i) {
+      connections_[i].next_due = interval_ns_ * i / connections_.size();
+    }
+
+    warmup_ns_ = warmup_ns;
+    auto const drain_ns = end_ns + 2'000'000'000;
+    std::array<epoll_event, 256> events;
+    while (true) {
+      auto const now = elapsed_ns(start);
+      bool idle = true;
+      std::uint64_t wake = drain_ns;
+      for (std::size_t i = 0; i < connections_.size(); ++i) {
+        auto& c = connections_[i];
+        while (c.next_due <= now && c.next_due < end_ns) {
+          c.pending.push_back(c.next_due);
+          c.next_due += interval_ns_;
+        }
+        if (c.next_due < end_ns) {
+          wake = std::min(wake, c.next_due);
+        }
+        pump(i);
+        idle = idle && c.pending.empty() && c.inflight.empty();
+      }
+      if (now >= drain_ns || (now >= end_ns && idle)) {
+        break;
+      }
+
+      itimerspec spec{};
+      auto const delay = wake > now ? wake - now : 1;
+      spec.it_value.tv_sec = static_cast<time_t>(delay / 1'000'000'000);
+      spec.it_value.tv_nsec = static_cast<long>(delay % 1'000'000'000);
+      timerfd_settime(timer_, 0, &spec, nullptr);
+
+      int const n = epoll_wait(epoll_, events.data(), events.size(), -1);
+      for (int i = 0; i < n; ++i) {
+        auto const id = events[i].data.u64;
+        if (id == connections_.size()) {
+          std::uint64_t expirations;
+          [[maybe_unused]] auto _ = read(timer_, &expirations, sizeof(expirations));
+          continue;
+        }
+        on_event(id, events[i].events, start);
+      }
+    }
+
+    for (auto& c : connections_) {
+      result_.incomplete += c.pending.size() + c.inflight.size();
+      if (c.fd >= 0) {
+        close(c.fd);
+      }
+    }
+    close(timer_);
+    close(epoll_);
+    return std::move(result_);
+  }
+
+private:
+  void pump(std::size_t id) {
+    auto& c = connections_[id];
+    if (c.fd < 0) {
+      if (!c.pending.empty()) {
+        open(id);
+      }
+      return;
+    }
+    if (c.connecting) {
+      return;
+    }
+    while (!c.pending.empty() && c.inflight.size() < mode_.depth &&
+           (mode_.per_connection == 0 || c.sent < mode_.per_connection)) {
+      ++c.sent;
+      bool const last = mode_.per_connection != 0 && c.sent == mode_.per_connection;
+      c.out.append(last ? last_request_ : request_);
+      c.inflight.push_back(c.pending.front());
+      c.pending.pop_front();
+    }
+    flush(id);
+  }
+
+  void open(std::size_t id) {
+    auto& c = connections_[id];
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port_);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ++result_.connects;
+    if (connect(c.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 &&
+        errno != EINPROGRESS) {
+      fail(id);
+      return;
+    }
+    c.connecting = true;
+    c.writing = true;
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.u64 = id;
+    epoll_ctl(epoll_, EPOLL_CTL_ADD, c.fd, &ev);
+  }
+
+  void flush(std::size_t id) {
+    auto& c = connections_[id];
+    while (c.written < c.out.size()) {
+      auto const n =
+          send(c.fd, c.out.data() + c.written, c.out.size() - c.written, MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          break;
+        }
+        fail(id);
+        return;
+      }
+      c.written += static_cast<std::size_t>(n);
+    }
+    if (c.written == c.out.size()) {
+      c.out.clear();
+      c.written = 0;
+    }
+    bool const writing = !c.out.empty();
+    if (writing != c.writing) {
+      c.writing = writing;
+      epoll_event ev{};
+      ev.events = writing ? EPOLLIN | EPOLLOUT : EPOLLIN;
+      ev.data.u64 = id;
+      epoll_ctl(epoll_, EPOLL_CTL_MOD, c.fd, &ev);
+    }
+  }
+
+  void on_event(std::size_t id, std::uint32_t events, Clock::time_point start) {
+    auto& c = connections_[id];
+    if (c.fd < 0) {
+      return;
+    }
+    if (c.connecting) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+        fail(id);
+        return;
+      }
+      c.connecting = false;
+      pump(id);
+      return;
+    }
+    if (events & EPOLLOUT) {
+      flush(id);
+    }
+    if (c.fd >= 0 && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+      receive(id, start);
+    }
+  }
+
+  void receive(std::size_t id, Clock::time_point start) {
+    auto& c = connections_[id];
+    char buf[16384];
+    bool eof = false;
+    while (true) {
+      auto const n = read(c.fd, buf, sizeof(buf));
+      if (n > 0) {
+        c.in.append(buf, static_cast<std::size_t>(n));
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      eof = true;
+      break;
+    }
+
+    auto const now = elapsed_ns(start);
+    std::size_t offset = 0;
+    while (!c.inflight.empty()) {
+      int status = 0;
+      auto const size = parse_response(std::string_view(c.in).substr(offset), status);
+      if (size < 0) {
+        fail(id);
+        return;
+      }
+      if (size == 0) {
+        break;
+      }
+      offset += static_cast<std::size_t>(size);
+      auto const intended = c.inflight.front();
+      c.inflight.pop_front();
+      if (intended < warmup_ns_) {
+        continue;
+      }
+      ++result_.completed;
+      if (status < 200 || status >= 300) {
+        ++result_.non_2xx;
+      }
+      result_.latency.record(now - intended);
+    }
+    c.in.erase(0, offset);
+
+    bool const exhausted = mode_.per_connection != 0 && c.sent >= mode_.per_connection;
+    if (eof || (exhausted && c.inflight.empty())) {
+      result_.errors += c.inflight.size();
+      reset(id);
+    }
+  }
+
+  void fail(std::size_t id) {
+    auto& c = connections_[id];
+    result_.errors += c.inflight.size() + 1;
+    reset(id);
+  }
+
+  void reset(std::size_t id) {
+    auto& c = connections_[id];
+    if (c.fd >= 0) {
+      epoll_ctl(epoll_, EPOLL_CTL_DEL, c.fd, nullptr);
+      close(c.fd);
+    }
+    c.fd = -1;
+    c.connecting = false;
+    c.writing = false;
+    c.out.clear();
+    c.written = 0;
+    c.in.clear();
+    c.inflight.clear();
+    c.sent = 0;
+  }
+
+  std::uint16_t port_;
+  std::string request_;
+  std::string last_request_;
+  Mode mode_;
+  std::vector<Connection> connections_;
+  std::uint64_t interval_ns_;
+  std::uint64_t warmup_ns_{0};
+  int epoll_{-1};
+  int timer_{-1};
+  Result result_;
+};
+
+struct Scenario {
+  std::string name;
+  std::string path;
+  std::function<void(App&)> setup;
+};
+
+std::vector<Scenario> scenarios(std::filesystem::path const& root) {
+  return {
+      {"hello", "/",
+       [](App& app) { app.get("/", []() { return R"({"message":"Hello, world!"})"; }); }},
+      {"router", "/users/42",
+       [](App& app) {
+         Router users(app, "/users");
+         users.get("/", []() { return R"({"users":[]})"; });
+         users.get("/{id:int}", [](int id) { return fmt::format(R"({{"id":{}}})", id); });
+       }},
+      // The example's logger middleware writes every request to stdout, which would dominate
+      // the measurement, so the tracer stands in for it.
+      {"middleware", "/",
+       [](App& app) {
+         app.use(filter::trace("api-"));
+         app.use(middleware::tracer());
+         app.get("/", []() { return R"({"message":"Hello, world!"})"; });
+       }},
+      // As in the example, with the tracer in place of its logger for the same reason.
+      {"static", "/index.html",
+       [root](App& app) {
+         app.use(middleware::tracer());
+         app.get("/{path:string}", serve_static(root));
+       }},
+  };
+}
+
+folly::dynamic run(Scenario const& scenario, Mode const& mode) {
+  App app(AppOptions{.host = "127.0.0.1", .port = 0, .threads = FLAGS_server_threads});
+  scenario.setup(app);
+  auto ready = app.ready();
+  std::thread server([&] { app.run(); });
+  auto const port = std::move(ready).get(std::chrono::seconds(10)).getPort();
+
+  auto const request = fmt::format("GET {} HTTP/1.1\r\nHost: localhost\r\n\r\n", scenario.path);
+  auto const threads = std::max<std::size_t>(1, std::min(FLAGS_threads, FLAGS_connections));
+  auto const interval_ns = static_cast<std::uint64_t>(
+      1e9 * static_cast<double>(FLAGS_connections) / static_cast<double>(FLAGS_rate)
+  );
+  auto const warmup_ns = static_cast<std::uint64_t>(FLAGS_warmup * 1e9);
+  auto const end_ns = warmup_ns + static_cast<std::uint64_t>(FLAGS_duration * 1e9);
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  for (std::size_t i = 0; i < threads; ++i) {
+    auto const connections = FLAGS_connections / threads + (i < FLAGS_connections % threads);
+    workers.push_back(std::make_unique<Worker>(port, request, mode, connections, interval_ns));
+  }
+  std::vector<Result> results(threads);
+  std::vector<std::thread> clients;
+  auto const start = Clock::now();
+  for (std::size_t i = 0; i < threads; ++i) {
+    clients.emplace_back([&, i] { results[i] = workers[i]->run(start, warmup_ns, end_ns); });
+  }
+  for (auto& client : clients) {
+    client.join();
+  }
+  app.stop();
+  server.join();
+
+  Result total;
+  for (auto const& result : results) {
+    total.latency.merge(result.latency);
+    total.completed += result.completed;
+    total.errors += result.errors;
+    total.non_2xx += result.non_2xx;
+    total.incomplete += result.incomplete;
+    total.connects += result.connects;
+  }
+  auto const us = [&](double p) {
+    return static_cast<double>(total.latency.percentile(p)) / 1000.0;
+  };
+  auto const throughput = static_cast<double>(total.completed) / FLAGS_duration;
+  fmt::print(
+      stderr, "{:<10} {:<9} {:>10.0f} req/s  p50 {:>9.1f}us  p99 {:>9.1f}us  p99.9 {:>9.1f}us\n",
+      scenario.name, mode.name, throughput, us(50), us(99), us(99.9)
+  );
+  return folly::dynamic::object("scenario", scenario.name)("mode", mode.name)(
+      "target_rps", static_cast<std::int64_t>(FLAGS_rate)
+  )("throughput_rps", throughput)("completed", static_cast<std::int64_t>(total.completed))(
+      "errors", static_cast<std::int64_t>(total.errors)
+  )("non_2xx", static_cast<std::int64_t>(total.non_2xx))(
+      "incomplete", static_cast<std::int64_t>(total.incomplete)
+  )("connects", static_cast<std::int64_t>(total.connects))(
+      "latency_us", folly::dynamic::object("p50", us(50))("p90", us(90))("p99", us(99))(
+                        "p99.9", us(99.9)
+                    )("max", static_cast<double>(total.latency.max()) / 1000.0)
+  );
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (FLAGS_rate == 0 || FLAGS_connections == 0) {
+    fmt::print(stderr, "--rate and --connections must be positive\n");
+    return 1;
+  }
+
+  auto root = std::filesystem::temp_directory_path() / fmt::format("wrap-loadgen-{}", getpid());
+  std::filesystem::create_directories(root);
+  std::ofstream(root / "index.html") << "<!doctype html><title>wrap</title><p>Hello, world!</p>\n";
+
+  std::vector<Mode> const modes = {
+      {"keepalive", 1, 0},
+      {"pipeline", std::max<std::size_t>(1, FLAGS_pipeline), 0},
+      {"churn", 1, 1},
+  };
+  std::vector<std::string> scenario_names;
+  std::vector<std::string> mode_names;
+  folly::split(',', FLAGS_scenarios, scenario_names, true);
+  folly::split(',', FLAGS_modes, mode_names, true);
+
+  folly::dynamic runs = folly::dynamic::array;
+  for (auto const& scenario : scenarios(root)) {
+    if (std::find(scenario_names.begin(), scenario_names.end(), scenario.name) ==
+        scenario_names.end()) {
+      continue;
+    }
+    for (auto const& mode : modes) {
+      if (std::find(mode_names.begin(), mode_names.end(), mode.name) != mode_names.end()) {
+        runs.push_back(run(scenario, mode));
+      }
+    }
+  }
+  std::filesystem::remove_all(root);
+
+  auto const out = folly::toPrettyJson(folly::dynamic::object("version", WRAP_VERSION)(
+      "config", folly::dynamic::object("rate", static_cast<std::int64_t>(FLAGS_rate))(
+                    "connections", static_cast<std::int64_t>(FLAGS_connections)
+                )("pipeline", static_cast<std::int64_t>(FLAGS_pipeline))(
+                    "threads", static_cast<std::int64_t>(FLAGS_threads)
+                )("server_threads", static_cast<std::int64_t>(FLAGS_server_threads))(
+                    "duration_s", FLAGS_duration
+                )("warmup_s", FLAGS_warmup)
+  )("runs", std::move(runs)));
+  if (FLAGS_output.empty()) {
+    fmt::print("{}\n", out);
+  } else {
+    std::ofstream(FLAGS_output) << out << "\n";
+  }
+  return 0;
+}
@@ -0,0 +1,320 @@
+#include <arpa/inet.h>
+#include <fizz/client/FizzClientContext.h>
+#include <fizz/protocol/CertificateVerifier.h>
+#include <fmt/format.h>
+#include <folly/String.h>
+#include <folly/io/async/EventBase.h>
+#include <folly/json/json.h>
+#include <gflags/gflags.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <proxygen/lib/http/session/HQUpstreamSession.h>
+#include <quic/client/QuicClientTransport.h>
+#include <quic/common/events/FollyQuicEventBase.h>
+#include <quic/common/udpsocket/FollyQuicAsyncUDPSocket.h>
+#include <quic/fizz/client/handshake/FizzClientQuicHandshakeContext.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "wrap/app.h"
+
+DEFINE_string(loss, "0,0.01,0.05,0.1", "Comma-separated packet loss rates to inject");
+DEFINE_uint64(connections, 20, "Connections per loss rate, opened one after another");
+DEFINE_uint64(requests, 50, "Sequential requests per connection");
+DEFINE_uint32(http3_port, 4433, "UDP port of the HTTP/3 listener");
+DEFINE_string(cert, "", "PEM certificate for the HTTP/3 listener");
+DEFINE_string(key, "", "PEM private key for the HTTP/3 listener");
+DEFINE_string(output, "", "Write JSON results to this file instead of stdout");
+
+using namespace wrap;
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+constexpr auto request_timeout = std::chrono::seconds(10);
+
+// Forwards datagrams between the most recent client and `server` on loopback, dropping each
+// with probability `loss` in both directions, so loss applies without tc/netem.
+class LossyRelay {
+public:
+  LossyRelay(std::uint16_t server_port, double loss, std::uint64_t seed) : loss_(loss), rng_(seed) {
+    server_.sin_family = AF_INET;
+    server_.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server_.sin_port = htons(server_port);
+
+    fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    bind(fd_, reinterpret_cast<sockaddr*>(&addr), len);
+    getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &len);
+    port_ = ntohs(addr.sin_port);
+    thread_ = std::thread([this] { forward(); });
+  }
+
+  ~LossyRelay() {
+    stop_.store(true, std::memory_order_relaxed);
+    thread_.join();
+    close(fd_);
+  }
+
+  std::uint16_t port() const { return port_; }
+
+  std::uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+  void forward() {
+    std::array<char, 65536> buf;
+    std::bernoulli_distribution drop(loss_);
+    sockaddr_in client{};
+    while (!stop_.load(std::memory_order_relaxed)) {
+      pollfd pfd{fd_, POLLIN, 0};
+      if (poll(&pfd, 1, 100) <= 0) {
+        continue;
+      }
+      sockaddr_in from{};
+      socklen_t len = sizeof(from);
+      auto const n =
+          recvfrom(fd_, buf.data(), buf.size(), 0, reinterpret_cast<sockaddr*>(&from), &len);
+      if (n < 0) {
+        continue;
+      }
+      if (drop(rng_)) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+      bool const upstream = from.sin_port == server_.sin_port &&
+                            from.sin_addr.s_addr == server_.sin_addr.s_addr;
+      if (!upstream) {
+        client = from;
+      }
+      auto const& to = upstream ? client : server_;
+      sendto(fd_, buf.data(), n, 0, reinterpret_cast<sockaddr const*>(&to), sizeof(to));
+    }
+  }
+
+  double loss_;
+  std::mt19937_64 rng_;
+  sockaddr_in server_{};
+  int fd_;
+  std::uint16_t port_;
+  std::atomic<bool> stop_{false};
+  std::atomic<std::uint64_t> dropped_{0};
+  std::thread thread_;
+};
+
+// The listener's certificate is self-signed for the benchmark.
+class AcceptAnyCertificate final : public fizz::CertificateVerifier {
+public:
+  std::shared_ptr<folly::AsyncTransportCertificate const> verify(
+      std::vector<std::shared_ptr<fizz::PeerCert const>> const& certs
+  ) const override {
+    return certs.front();
+  }
+
+  std::vector<fizz::Extension> getCertificateRequestExtensions() const override { return {}; }
+};
+
+class Connect final : public proxygen::HQSession::ConnectCallback {
+public:
+  void connectSuccess() override { done = true; }
+
+  void connectError(quic::QuicError) override {
+    done = true;
+    failed = true;
+  }
+
+  bool done{false};
+  bool failed{false};
+};
+
+class Fetch final : public proxygen::HTTPTransactionHandler {
+public:
+  void setTransaction(proxygen::HTTPTransaction*) noexcept override {}
+
+  void detachTransaction() noexcept override { done = true; }
+
+  void onHeadersComplete(std::unique_ptr<proxygen::HTTPMessage> msg) noexcept override {
+    status = msg->getStatusCode();
+  }
+
+  void onBody(std::unique_ptr<folly::IOBuf>) noexcept override {}
+
+  void onTrailers(std::unique_ptr<proxygen::HTTPHeaders>) noexcept override {}
+
+  void onEOM() noexcept override {}
+
+  void onUpgrade(proxygen::UpgradeProtocol) noexcept override {}
+
+  void onError(proxygen::HTTPException const&) noexcept override { failed = true; }
+
+  void onEgressPaused() noexcept override {}
+
+  void onEgressResumed() noexcept override {}
+
+  bool done{false};
+  bool failed{false};
+  std::uint16_t status{0};
+};
+
+struct Result {
+  std::vector<std::uint64_t> handshake;
+  std::vector<std::uint64_t> latency;
+  std::uint64_t errors{0};
+};
+
+std::uint64_t elapsed_ns(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+double percentile_us(std::vector<std::uint64_t>& values, double p) {
+  if (values.empty()) {
+    return 0;
+  }
+  std::sort(values.begin(), values.end());
+  auto const rank = static_cast<std::size_t>(std::ceil(p / 100.0 * values.size()));
+  return static_cast<double>(values[std::max<std::size_t>(rank, 1) - 1]) / 1000.0;
+}
+
+// Opens `connections` connections through `relay` one at a time and issues `requests`
+// sequential GETs on each, so every latency is a single round trip plus any recovery.
+Result measure(std::uint16_t relay_port) {
+  folly::EventBase evb;
+  auto qevb = std::make_shared<quic::FollyQuicEventBase>(&evb);
+  auto ctx = std::make_shared<fizz::client::FizzClientContext>();
+  ctx->setSupportedAlpns({"h3"});
+  auto const wait = [&](auto const& done) {
+    while (!done()) {
+      evb.loopOnce();
+    }
+  };
+
+  Result result;
+  for (std::uint64_t c = 0; c < FLAGS_connections; ++c) {
+    auto transport = std::make_shared<quic::QuicClientTransport>(
+        qevb, std::make_unique<quic::FollyQuicAsyncUDPSocket>(qevb),
+        quic::FizzClientQuicHandshakeContext::Builder()
+            .setFizzClientContext(ctx)
+            .setCertificateVerifier(std::make_shared<AcceptAnyCertificate>())
+            .build()
+    );
+    transport->setHostname("localhost");
+    transport->addNewPeerAddress(folly::SocketAddress("127.0.0.1", relay_port));
+
+    // Deletes itself once the connection is dropped.
+    auto* session = new proxygen::HQUpstreamSession(
+        request_timeout, request_timeout, nullptr, wangle::TransportInfo(), nullptr
+    );
+    Connect connect;
+    session->setSocket(transport);
+    session->setConnectCallback(&connect);
+    session->startNow();
+    auto const start = Clock::now();
+    transport->start(session, session);
+    wait([&] { return connect.done; });
+    if (connect.failed) {
+      ++result.errors;
+      session->dropConnection();
+      continue;
+    }
+    result.handshake.push_back(elapsed_ns(start));
+
+    for (std::uint64_t r = 0; r < FLAGS_requests; ++r) {
+      Fetch fetch;
+      proxygen::HTTPMessage msg;
+      msg.setMethod(proxygen::HTTPMethod::GET);
+      msg.setURL("/");
+      msg.getHeaders().set(proxygen::HTTP_HEADER_HOST, "localhost");
+      auto const sent = Clock::now();
+      auto* txn = session->newTransaction(&fetch);
+      if (!txn) {
+        ++result.errors;
+        break;
+      }
+      txn->sendHeaders(msg);
+      txn->sendEOM();
+      wait([&] { return fetch.done; });
+      if (fetch.failed || fetch.status != 200) {
+        ++result.errors;
+      } else {
+        result.latency.push_back(elapsed_ns(sent));
+      }
+    }
+    session->dropConnection();
+    evb.loopOnce(EVLOOP_NONBLOCK);
+  }
+  return result;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (FLAGS_cert.empty() || FLAGS_key.empty()) {
+    fmt::print(stderr, "--cert and --key are required\n");
+    return 1;
+  }
+
+  App app({
+      .host = "127.0.0.1",
+      .port = 0,
+      .threads = 1,
+      .http3_port = static_cast<std::uint16_t>(FLAGS_http3_port),
+      .cert = FLAGS_cert,
+      .key = FLAGS_key,
+  });
+  app.get("/", []() { return "Hello, world!"; });
+  auto ready = app.ready();
+  std::thread server([&] { app.run(); });
+  std::move(ready).get(std::chrono::seconds(10));
+
+  std::vector<std::string> rates;
+  folly::split(',', FLAGS_loss, rates, true);
+  folly::dynamic runs = folly::dynamic::array;
+  for (std::size_t i = 0; i < rates.size(); ++i) {
+    auto const loss = std::stod(rates[i]);
+    LossyRelay relay(static_cast<std::uint16_t>(FLAGS_http3_port), loss, i + 1);
+    auto result = measure(relay.port());
+    auto const latency = [&](double p) { return percentile_us(result.latency, p); };
+    auto const handshake = [&](double p) { return percentile_us(result.handshake, p); };
+    fmt::print(
+        stderr, "loss {:>5.1f}%  handshake p50 {:>9.1f}us  p50 {:>9.1f}us  p99 {:>9.1f}us\n",
+        loss * 100, handshake(50), latency(50), latency(99)
+    );
+    runs.push_back(folly::dynamic::object("loss", loss)(
+        "completed", static_cast<std::int64_t>(result.latency.size())
+    )("errors", static_cast<std::int64_t>(result.errors))(
+        "dropped_packets", static_cast<std::int64_t>(relay.dropped())
+    )("handshake_us", folly::dynamic::object("p50", handshake(50))("p99", handshake(99)))(
+        "latency_us", folly::dynamic::object("p50", latency(50))("p90", latency(90))(
+                          "p99", latency(99)
+                      )("max", latency(100))
+    ));
+  }
+  app.stop();
+  server.join();
+
+  auto const out = folly::toPrettyJson(folly::dynamic::object("version", WRAP_VERSION)(
+      "config", folly::dynamic::object("connections", static_cast<std::int64_t>(FLAGS_connections))(
+                    "requests", static_cast<std::int64_t>(FLAGS_requests)
+                )
+  )("runs", std::move(runs)));
+  if (FLAGS_output.empty()) {
+    fmt::print("{}\n", out);
+  } else {
+    std::ofstream(FLAGS_output) << out << "\n";
+  }
+  return 0;
+}
@@ -1,3 +1,37 @@
 #include <benchmark/benchmark.h>
 
+#include "wrap/app.h"
+
+using namespace wrap;
+
+static void BM_Dispatch(benchmark::State& state) {
+  App app;
+  app.get("/", []() { return "TEST"; });
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(app.dispatch(proxygen::HTTPMethod::GET, "/"));
+  }
+}
+BENCHMARK(BM_Dispatch);
+
+static void BM_DispatchParam(benchmark::State& state) {
+  App app;
+  app.get("/users/{id:int}", [](int id) { return std::to_string(id); });
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(app.dispatch(proxygen::HTTPMethod::GET, "/users/42"));
+  }
+}
+BENCHMARK(BM_DispatchParam);
+
+static void BM_DispatchQuery(benchmark::State& state) {
+  App app;
+  // The numeric parameters are bound and converted but not used.
+  app.get("/search", [](Query<"q"> q, Query<"limit", int>, Query<"page", int>) { return *q; });
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        app.dispatch(proxygen::HTTPMethod::GET, "/search?q=wrap&limit=10&page=2")
+    );
+  }
+}
+BENCHMARK(BM_DispatchQuery);
+
 BENCHMARK_MAIN();
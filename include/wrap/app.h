@@ -1,19 +1,34 @@
 #pragma once
 
+#include <folly/SocketAddress.h>
+#include <folly/Synchronized.h>
+#include <folly/ThreadLocal.h>
+#include <folly/futures/SharedPromise.h>
 #include <folly/json/json.h>
 #include <proxygen/httpserver/HTTPServer.h>
 #include <proxygen/httpserver/RequestHandlerFactory.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <tuple>
 #include <vector>
 
 #include "wrap/handler.h"
 #include "wrap/middleware.h"
+#include "wrap/params.h"
 #include "wrap/request.h"
 #include "wrap/response.h"
+#include "wrap/state.h"
 
 namespace wrap {
 namespace detail {
+class Http3Server;
+
 inline void send_json(
     Response& res, std::uint16_t code, std::string const& message, folly::dynamic const& body
 ) {
@@ -58,150 +73,360 @@ inline std::vector<std::string> braced_param_names(std::string const& path) {
 }
 
 template <class T>
-bool convert_param(std::string const& s, T& out) {
-  using U = std::remove_cvref_t<T>;
-  if constexpr (std::is_same_v<U, std::string>) {
-    out = s;
-    return true;
-  } else if constexpr (std::is_integral_v<U> && !std::is_same_v<U, bool>) {
-    if (s.empty()) {
-      return false;
-    }
-    std::uint64_t v = 0;
-    for (char c : s) {
-      if (c < '0' || c > '9') {
-        return false;
-      }
-      std::uint64_t d = static_cast<std::uint64_t>(c - '0');
-      if (v > (std::numeric_limits<std::uint64_t>::max() - d) / 10) {
-        return false;
-      }
-      v = v * 10 + d;
+struct is_injectable : std::false_type {};
+
+template <fixed_string Name, class T>
+struct is_injectable<Query<Name, T>> : std::true_type {};
+
+template <fixed_string Name, class T>
+struct is_injectable<Header<Name, T>> : std::true_type {};
+
+template <class F, class = void>
+struct callable_args {};
+
+template <class F>
+struct callable_args<F, std::void_t<decltype(&F::operator())>>
+    : callable_args<decltype(&F::operator())> {};
+
+template <class R, class... A>
+struct callable_args<R (*)(A...)> {
+  using type = std::tuple<std::remove_cvref_t<A>...>;
+};
+
+template <class R, class... A>
+struct callable_args<R (*)(A...) noexcept> : callable_args<R (*)(A...)> {};
+
+template <class C, class R, class... A>
+struct callable_args<R (C::*)(A...)> : callable_args<R (*)(A...)> {};
+
+template <class C, class R, class... A>
+struct callable_args<R (C::*)(A...) noexcept> : callable_args<R (*)(A...)> {};
+
+template <class C, class R, class... A>
+struct callable_args<R (C::*)(A...) const> : callable_args<R (*)(A...)> {};
+
+template <class C, class R, class... A>
+struct callable_args<R (C::*)(A...) const noexcept> : callable_args<R (*)(A...)> {};
+
+// Arguments that are not Query/Header bind to the route's braced path params in order.
+template <class T>
+struct is_path_param
+    : std::bool_constant<std::is_same_v<T, std::string> || std::is_arithmetic_v<T>> {};
+
+template <class Tuple>
+struct all_bindable;
+
+template <class... A>
+struct all_bindable<std::tuple<A...>>
+    : std::bool_constant<((is_injectable<A>::value || is_path_param<A>::value) && ...)> {};
+
+template <class Tuple>
+struct path_param_count;
+
+template <class... A>
+struct path_param_count<std::tuple<A...>>
+    : std::integral_constant<std::size_t, (std::size_t{!is_injectable<A>::value} + ... + 0)> {};
+
+template <class F>
+concept bindable = requires { typename callable_args<F>::type; } &&
+                   all_bindable<typename callable_args<F>::type>::value;
+
+template <class T>
+struct is_optional : std::false_type {};
+
+template <class T>
+struct is_optional<std::optional<T>> : std::true_type {};
+
+template <class T>
+bool inject_value(std::optional<std::string_view> raw, T& out) {
+  if constexpr (is_optional<T>::value) {
+    if (!raw) {
+      out.reset();
+      return true;
     }
-    if constexpr (std::is_signed_v<U>) {
-      if (v > static_cast<std::uint64_t>(std::numeric_limits<U>::max())) {
-        return false;
-      }
-      out = static_cast<U>(v);
-    } else {
-      if (v > static_cast<std::uint64_t>(std::numeric_limits<U>::max())) {
-        return false;
-      }
-      out = static_cast<U>(v);
+    typename T::value_type v{};
+    if (!convert_param(*raw, v)) {
+      return false;
     }
+    out = std::move(v);
     return true;
   } else {
-    static_assert(sizeof(T) == 0, "Unsupported path param type");
+    return raw && convert_param(*raw, out);
   }
 }
-}  // namespace detail
-
-class AppOptions {
-public:
-  std::string host{"0.0.0.0"};
-  std::uint16_t port{8080};
-  std::size_t threads{0};
-};
-
-class App final {
-public:
-  struct Route {
-    proxygen::HTTPMethod method;
-    std::string path;
-    Handler handler;
-  };
 
-  explicit App(AppOptions options = {});
-  ~App() = default;
+template <fixed_string Name, class T>
+bool inject(Request const& req, Query<Name, T>& out) {
+  return inject_value(req.getQuery().find(Name.view()), out.value);
+}
 
-  App& use(std::unique_ptr<proxygen::RequestHandlerFactory> filter) {
-    filters_.push_back(std::move(filter));
-    return *this;
+template <fixed_string Name, class T>
+bool inject(Request const& req, Header<Name, T>& out) {
+  auto const& headers = req.getHeaders();
+  std::optional<std::string_view> raw;
+  if (headers.exists(Name.view())) {
+    raw = headers.getSingleOrEmpty(Name.view());
   }
+  return inject_value(raw, out.value);
+}
 
-  App& use(Middleware middleware) {
-    middlewares_.push_back(std::move(middleware));
-    return *this;
+// 0 when bound, otherwise the status to respond with.
+template <class T>
+std::uint16_t bind_arg(
+    Request const& req, std::vector<std::string> const& names, std::size_t& index, T& out
+) {
+  if constexpr (is_injectable<T>::value) {
+    return inject(req, out) ? 0 : 400;
+  } else {
+    return convert_param(req.getParam(names[index++]), out) ? 0 : 404;
   }
+}
 
-  App& post(std::string const& path, Handler handler);
-  App& put(std::string const& path, Handler handler);
-  App& get(std::string const& path, Handler handler);
-
-  template <class F>
-  App& get(std::string const& path, F&& func) {
-    auto const names = detail::braced_param_names(path);
-    Handler h = [f = std::forward<F>(func), names](Request const& req, Response& res) mutable {
+// Adapts `func` to a Handler. Besides Handler's own signature, it may take no arguments, path
+// params in route order, Query/Header values, or a mix of the last two, and return a string,
+// folly::dynamic or nothing.
+template <class F>
+Handler make_handler(std::string const& path, F&& func) {
+  using Fn = std::decay_t<F>;
+  if constexpr (std::is_invocable_v<Fn&, Request const&, Response&>) {
+    return Handler(std::forward<F>(func));
+  } else {
+    auto const names = braced_param_names(path);
+    return [f = Fn(std::forward<F>(func)), names](Request const& req, Response& res) mutable {
       try {
         auto call_and_respond = [&](auto&&... args) {
-          using Ret = std::invoke_result_t<decltype(f)&, decltype(args)...>;
+          using Ret = std::invoke_result_t<Fn&, decltype(args)...>;
           if constexpr (std::is_void_v<Ret>) {
             std::invoke(f, std::forward<decltype(args)>(args)...);
-            detail::send_no_content(res);
+            send_no_content(res);
           } else {
             auto out = std::invoke(f, std::forward<decltype(args)>(args)...);
             if constexpr (std::is_convertible_v<decltype(out), std::string_view>) {
-              detail::send_ok(res, std::string_view(out));
+              send_ok(res, std::string_view(out));
             } else if constexpr (std::is_same_v<
                                      std::remove_cvref_t<decltype(out)>, folly::dynamic>) {
-              detail::send_json(res, 200, "OK", out);
+              send_json(res, 200, "OK", out);
             } else {
               static_assert(sizeof(out) == 0, "Unsupported handler return type");
             }
           }
         };
-        if constexpr (std::invocable<decltype(f)&>) {
+        if constexpr (std::is_invocable_v<Fn&>) {
           if (!names.empty()) {
-            detail::send_error(res, 500, "Internal Server Error");
+            send_error(res, 500, "Internal Server Error");
             return;
           }
           call_and_respond();
-          return;
-        }
-        if constexpr (std::invocable<decltype(f)&, int>) {
+        } else if constexpr (bindable<Fn>) {
+          using Args = typename callable_args<Fn>::type;
+          if (names.size() != path_param_count<Args>::value) {
+            send_error(res, 500, "Internal Server Error");
+            return;
+          }
+          Args args;
+          std::size_t index = 0;
+          std::uint16_t status = 0;
+          std::apply(
+              [&](auto&... xs) {
+                ((status = status ? status : bind_arg(req, names, index, xs)), ...);
+              },
+              args
+          );
+          if (status) {
+            send_error(res, status, status == 404 ? "Not Found" : "Bad Request");
+            return;
+          }
+          std::apply([&](auto&... xs) { call_and_respond(std::move(xs)...); }, args);
+        } else if constexpr (std::is_invocable_v<Fn&, int>) {
           if (names.size() != 1) {
-            detail::send_error(res, 500, "Internal Server Error");
+            send_error(res, 500, "Internal Server Error");
             return;
           }
           int v{};
-          if (!detail::convert_param(req.getParam(names[0]), v)) {
-            detail::send_error(res, 404, "Not Found");
+          if (!convert_param(req.getParam(names[0]), v)) {
+            send_error(res, 404, "Not Found");
             return;
           }
           call_and_respond(v);
-          return;
-        }
-        if constexpr (std::invocable<decltype(f)&, std::string>) {
+        } else if constexpr (std::is_invocable_v<Fn&, std::string>) {
           if (names.size() != 1) {
-            detail::send_error(res, 500, "Internal Server Error");
-            return;
-          }
-          std::string v{};
-          if (!detail::convert_param(req.getParam(names[0]), v)) {
-            detail::send_error(res, 404, "Not Found");
+            send_error(res, 500, "Internal Server Error");
             return;
           }
-          call_and_respond(std::move(v));
-          return;
+          call_and_respond(req.getParam(names[0]));
+        } else {
+          send_error(res, 500, "Internal Server Error");
         }
-        detail::send_error(res, 500, "Internal Server Error");
       } catch (...) {
-        detail::send_error(res, 500, "Internal Server Error");
+        send_error(res, 500, "Internal Server Error");
       }
     };
-    return get(path, std::move(h));
+  }
+}
+}  // namespace detail
+
+class AppOptions {
+public:
+  std::string host{"0.0.0.0"};
+  std::uint16_t port{8080};
+  std::size_t threads{0};
+  // Also serves HTTP/3 on this UDP port when set and advertises it to TCP clients via
+  // Alt-Svc. Needs a build with WRAP_WITH_HTTP3 and a PEM certificate and key.
+  std::optional<std::uint16_t> http3_port;
+  std::string cert;
+  std::string key;
+  // Accepts 0-RTT requests on resumed HTTP/3 connections. Only idempotent methods are served
+  // from early data, and handlers can tell by Request::isEarlyData().
+  bool early_data{false};
+  // How long dispatch() waits for a mount that responds asynchronously before giving up with
+  // 504.
+  std::chrono::milliseconds dispatch_timeout{30000};
+};
+
+class LocalResponse {
+public:
+  std::uint16_t status{0};
+  std::string message;
+  proxygen::HTTPHeaders headers;
+  std::string body;
+};
+
+class App final {
+public:
+  struct Route {
+    proxygen::HTTPMethod method;
+    std::string path;
+    Handler handler;
+  };
+
+  struct Mount {
+    std::string prefix;
+    std::unique_ptr<proxygen::RequestHandlerFactory> factory;
+  };
+
+  // Immutable snapshot of routes and middleware that requests read without locking.
+  struct Table;
+
+  explicit App(AppOptions options = {});
+  ~App();
+
+  // Filters, mounts and state are read by IO threads without locking, so unlike routes and
+  // middleware they must all be registered before run().
+  App& use(std::unique_ptr<proxygen::RequestHandlerFactory> filter) {
+    filters_.push_back(std::move(filter));
+    return *this;
   }
 
+  App& use(Middleware middleware);
+
+  // Hands every request under `prefix` to handlers from `factory`, bypassing routes and
+  // middleware. The factory sees the server's onServerStart/onServerStop on each IO thread.
+  App& mount(std::string prefix, std::unique_ptr<proxygen::RequestHandlerFactory> factory);
+
+  // Gives each IO thread its own T, created at server start and destroyed at stop, which
+  // handlers reach through Request::state<T>() without locking. Requests handled outside
+  // the IO threads, by dispatch() or as batch sub-requests, see null instead.
+  template <class T>
+  App& state(std::function<std::unique_ptr<T>(folly::EventBase*)> factory) {
+    auto const slot = detail::state_slot<T>();
+    if (state_factories_.size() <= slot) {
+      state_factories_.resize(slot + 1);
+    }
+    state_factories_[slot] = [factory = std::move(factory)](folly::EventBase* evb) {
+      return std::shared_ptr<void>(factory(evb));
+    };
+    return *this;
+  }
+
+  template <class T>
+  App& state() {
+    return state<T>([](folly::EventBase*) { return std::make_unique<T>(); });
+  }
+
+  App& post(std::string const& path, Handler handler);
+  App& put(std::string const& path, Handler handler);
+  App& get(std::string const& path, Handler handler);
+
+  // Routes and middleware may change while the server runs. Each change publishes a new
+  // table; requests already in flight finish against the one they started with. Filters,
+  // mounts and state cannot; see use() above.
+  App& replace(proxygen::HTTPMethod method, std::string const& path, Handler handler);
+  bool remove(proxygen::HTTPMethod method, std::string const& path);
+
+  // Accepts any callable detail::make_handler() can adapt.
+  template <class F>
+  App& post(std::string const& path, F&& func) {
+    return post(path, detail::make_handler(path, std::forward<F>(func)));
+  }
+
+  template <class F>
+  App& put(std::string const& path, F&& func) {
+    return put(path, detail::make_handler(path, std::forward<F>(func)));
+  }
+
+  template <class F>
+  App& get(std::string const& path, F&& func) {
+    return get(path, detail::make_handler(path, std::forward<F>(func)));
+  }
+
+  // Feeds a request through the filter chain and route table in-process and captures the
+  // response, without opening a socket. Mounts that respond asynchronously are waited for on
+  // the calling thread's event base for up to AppOptions::dispatch_timeout, unless that loop
+  // is the one already running the call.
+  // proxy() mounts need the server's IO threads and answer 503 here.
+  LocalResponse dispatch(
+      std::unique_ptr<proxygen::HTTPMessage> msg, std::unique_ptr<folly::IOBuf> body = nullptr
+  );
+  LocalResponse dispatch(
+      proxygen::HTTPMethod method, std::string const& url, std::string const& body = {}
+  );
+
+  // Completes with the bound address once run() is accepting connections on every IO thread,
+  // which reports the actual port when listening on port 0, or with the error if it fails to
+  // start. After a run has stopped, the next run() starts a new future.
+  folly::SemiFuture<folly::SocketAddress> ready() {
+    std::lock_guard lock(run_mutex_);
+    return ready_.getSemiFuture();
+  }
+
+  // IO thread event bases of the running server.
+  std::vector<folly::EventBase*> eventBases() const;
+
   void run(std::string const& host, std::uint16_t port);
   void run();
 
+  // Asks a running run() to return; safe from any thread, and a no-op when not running.
   void stop();
 
 private:
+  App& route(proxygen::HTTPMethod method, std::string const& path, Handler handler);
+  void update(
+      std::function<void(std::vector<Route>&, std::vector<Middleware>&)> const& change
+  );
+  // Compiles the pending registrations into the table. Once `started`, later changes are
+  // compiled and published one at a time.
+  void publish(bool started);
+
   AppOptions options_;
+  // Guards ready_ renewal and main_evb_; run() owns everything else it starts.
+  std::mutex run_mutex_;
+  folly::SharedPromise<folly::SocketAddress> ready_;
+  folly::EventBase* main_evb_{nullptr};
   std::unique_ptr<proxygen::HTTPServer> server_;
+  std::unique_ptr<proxygen::RequestHandlerFactory> http3_factory_;
+  std::unique_ptr<detail::Http3Server> http3_;
+  std::atomic<Table const*> table_;
+  std::mutex mutex_;
+  // Registrations made before run() collect here and are compiled once, not per call.
   std::vector<Route> routes_;
-  std::vector<std::unique_ptr<proxygen::RequestHandlerFactory>> filters_;
   std::vector<Middleware> middlewares_;
+  std::atomic<bool> pending_{false};
+  bool started_{false};
+  std::vector<std::unique_ptr<proxygen::RequestHandlerFactory>> filters_;
+  std::vector<Mount> mounts_;
+  std::vector<detail::StateFactory> state_factories_;
+  folly::ThreadLocalPtr<detail::State> state_;
+  folly::Synchronized<std::vector<folly::EventBase*>, std::mutex> evbs_;
+  std::condition_variable evbs_changed_;
 };
 }  // namespace wrap
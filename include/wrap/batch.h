@@ -0,0 +1,243 @@
+#pragma once
+
+#include <folly/executors/GlobalExecutor.h>
+#include <folly/futures/Future.h>
+#include <folly/io/async/EventBaseManager.h>
+#include <proxygen/httpserver/RequestHandler.h>
+#include <proxygen/httpserver/RequestHandlerFactory.h>
+#include <proxygen/httpserver/ResponseBuilder.h>
+#include <proxygen/httpserver/filters/DirectResponseHandler.h>
+#include <proxygen/lib/http/HTTPMethod.h>
+
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "wrap/app.h"
+#include "wrap/request.h"
+#include "wrap/response.h"
+
+namespace wrap {
+class BatchOptions {
+public:
+  std::size_t concurrency{8};
+  std::size_t max_requests{32};
+};
+
+namespace detail {
+inline constexpr char const* batch_header = "X-Wrap-Batch";
+
+inline folly::dynamic dispatch_batch_item(
+    App& app, folly::SocketAddress const& client, folly::dynamic const& item
+) {
+  try {
+    if (!item.isObject()) {
+      return folly::dynamic::object("status", 400)("body", "Invalid sub-request");
+    }
+    auto method = proxygen::stringToMethod(item.getDefault("method", "GET").asString());
+    auto url = item.getDefault("url", "").asString();
+    if (!method || url.empty() || url.front() != '/') {
+      return folly::dynamic::object("status", 400)("body", "Invalid sub-request");
+    }
+    auto msg = std::make_unique<proxygen::HTTPMessage>();
+    msg->setMethod(*method);
+    msg->setURL(url);
+    msg->setHTTPVersion(1, 1);
+    msg->setClientAddress(client);
+    if (auto const* headers = item.get_ptr("headers"); headers && headers->isObject()) {
+      for (auto const& [name, value] : headers->items()) {
+        msg->getHeaders().add(name.asString(), value.asString());
+      }
+    }
+    msg->getHeaders().set(batch_header, "1");
+    std::unique_ptr<folly::IOBuf> body;
+    if (auto const* data = item.get_ptr("body"); data && !data->isNull()) {
+      auto const str = data->isString() ? data->asString() : folly::toJson(*data);
+      if (!data->isString() && !msg->getHeaders().exists("Content-Type")) {
+        msg->getHeaders().set("Content-Type", "application/json");
+      }
+      msg->getHeaders().set(proxygen::HTTP_HEADER_CONTENT_LENGTH, std::to_string(str.size()));
+      body = folly::IOBuf::copyBuffer(str);
+    }
+    auto res = app.dispatch(std::move(msg), std::move(body));
+    folly::dynamic headers = folly::dynamic::object;
+    res.headers.forEach([&](std::string const& name, std::string const& value) {
+      headers[name] = value;
+    });
+    return folly::dynamic::object("status", res.status)("headers", std::move(headers))(
+        "body", std::move(res.body)
+    );
+  } catch (std::exception const& e) {
+    return folly::dynamic::object("status", 400)("body", e.what());
+  }
+}
+
+// Fans sub-requests out to the CPU executor and streams the response array from this request's
+// event base, writing each item as soon as those before it are done, so the IO thread keeps
+// serving other connections meanwhile.
+class BatchHandler final : public proxygen::RequestHandler {
+public:
+  BatchHandler(App& app, BatchOptions options) : app_(app), options_(options) {}
+
+  void onRequest(std::unique_ptr<proxygen::HTTPMessage> request) noexcept override {
+    request_ = std::move(request);
+  }
+
+  void onBody(std::unique_ptr<folly::IOBuf> body) noexcept override {
+    if (body_) {
+      body_->prependChain(std::move(body));
+    } else {
+      body_ = std::move(body);
+    }
+  }
+
+  void onEOM() noexcept override {
+    auto request = Request(request_.get(), body_.get());
+    if (!request.getHeader(batch_header).empty()) {
+      fail(400, "Nested batch requests are not allowed");
+      return;
+    }
+    folly::dynamic items;
+    try {
+      items = request.json();
+    } catch (...) {
+      fail(400, "Invalid JSON");
+      return;
+    }
+    if (!items.isArray()) {
+      fail(400, "Expected an array of sub-requests");
+      return;
+    }
+    if (items.size() > options_.max_requests) {
+      fail(413, "Too many sub-requests");
+      return;
+    }
+
+    auto executor = folly::getGlobalCPUExecutor();
+    auto futures = folly::window(
+        executor, std::vector<folly::dynamic>(items.begin(), items.end()),
+        [&app = app_, executor, client = request.getClientAddress()](folly::dynamic item) {
+          return folly::via(executor, [&app, client, item = std::move(item)] {
+            return dispatch_batch_item(app, client, item);
+          });
+        },
+        std::max<std::size_t>(options_.concurrency, 1)
+    );
+    proxygen::ResponseBuilder(downstream_)
+        .status(200, "OK")
+        .header("Content-Type", "application/json")
+        .body(std::string("["))
+        .send();
+    results_.resize(futures.size());
+    outstanding_ = futures.size();
+    if (futures.empty()) {
+      flush();
+      return;
+    }
+    auto evb = folly::getKeepAliveToken(folly::EventBaseManager::get()->getEventBase());
+    for (std::size_t i = 0; i < futures.size(); ++i) {
+      std::move(futures[i]).via(evb).thenTry([this, i](folly::Try<folly::dynamic> result) {
+        --outstanding_;
+        if (aborted_) {
+          if (outstanding_ == 0) {
+            delete this;
+          }
+          return;
+        }
+        if (result.hasValue()) {
+          results_[i] = std::move(result).value();
+        } else {
+          results_[i] = folly::dynamic::object("status", 500)("body", "Internal Server Error");
+        }
+        flush();
+      });
+    }
+  }
+
+  void onUpgrade(proxygen::UpgradeProtocol) noexcept override {}
+
+  void requestComplete() noexcept override { delete this; }
+
+  // The sub-requests cannot be recalled, so a pending batch cleans up once they finish.
+  void onError(proxygen::ProxygenError) noexcept override {
+    if (outstanding_ != 0) {
+      aborted_ = true;
+    } else {
+      delete this;
+    }
+  }
+
+private:
+  // Writes the finished items that are next in request order, and closes the array after the
+  // last one. Sending the EOM may complete the request and delete this handler.
+  void flush() {
+    std::string out;
+    for (; next_ < results_.size() && results_[next_]; ++next_) {
+      if (next_ != 0) {
+        out.push_back(',');
+      }
+      out.append(folly::toJson(*results_[next_]));
+      results_[next_].reset();
+    }
+    if (next_ < results_.size()) {
+      if (!out.empty()) {
+        proxygen::ResponseBuilder(downstream_).body(std::move(out)).send();
+      }
+      return;
+    }
+    out.push_back(']');
+    proxygen::ResponseBuilder(downstream_).body(std::move(out)).sendWithEOM();
+  }
+
+  void fail(std::uint16_t code, std::string const& detail) {
+    proxygen::ResponseBuilder builder(downstream_);
+    Response response(&builder);
+    send_error(response, code, detail);
+    builder.sendWithEOM();
+  }
+
+  App& app_;
+  BatchOptions options_;
+  std::unique_ptr<proxygen::HTTPMessage> request_;
+  std::unique_ptr<folly::IOBuf> body_;
+  std::vector<std::optional<folly::dynamic>> results_;
+  std::size_t next_{0};
+  std::size_t outstanding_{0};
+  bool aborted_{false};
+};
+
+class BatchFactory final : public proxygen::RequestHandlerFactory {
+public:
+  BatchFactory(App& app, BatchOptions options) : app_(app), options_(options) {}
+
+  void onServerStart(folly::EventBase*) noexcept override {}
+
+  void onServerStop() noexcept override {}
+
+  proxygen::RequestHandler* onRequest(
+      proxygen::RequestHandler*, proxygen::HTTPMessage* msg
+  ) noexcept override {
+    if (msg->getMethod() != proxygen::HTTPMethod::POST) {
+      return new proxygen::DirectResponseHandler(405, "Method Not Allowed", "");
+    }
+    return new BatchHandler(app_, options_);
+  }
+
+private:
+  App& app_;
+  BatchOptions options_;
+};
+}  // namespace detail
+
+// Accepts a POSTed JSON array of {"method", "url", "headers", "body"} sub-requests, dispatches
+// them in-process on the CPU executor with at most `concurrency` in flight, and streams back a
+// JSON array of {"status", "headers", "body"} in the same order. Mount it with App::mount().
+// Sub-requests do not reach proxy() mounts, which answer them with 503.
+inline std::unique_ptr<proxygen::RequestHandlerFactory> batch(
+    App& app, BatchOptions options = {}
+) {
+  return std::make_unique<detail::BatchFactory>(app, options);
+}
+}  // namespace wrap
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+
+#include "wrap/app.h"
+
+namespace wrap::debug {
+class Options {
+public:
+  std::string prefix{"/debug"};
+  // When set, requests must carry "Authorization: Bearer <token>".
+  std::string token;
+  bool loopback_only{true};
+  std::chrono::seconds max_duration{30};
+};
+
+// Registers GET <prefix>/pprof/profile, <prefix>/pprof/heap and <prefix>/loops. Nothing is
+// sampled or collected until one of these routes is requested. The profile and loop stats are
+// mounted rather than routed so they can respond when sampling or probing ends without holding
+// up their IO thread.
+void install(App& app, Options options = {});
+}  // namespace wrap::debug
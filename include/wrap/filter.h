@@ -4,6 +4,7 @@
 #include <proxygen/httpserver/RequestHandler.h>
 #include <proxygen/httpserver/RequestHandlerFactory.h>
 
+#include <chrono>
 #include <memory>
 #include <string>
 #include <tuple>
@@ -26,6 +27,23 @@ private:
   inline static std::atomic<std::uint64_t> counter_{1};
 };
 
+// Advertises an alternative service, such as an HTTP/3 listener, unless the handler set one.
+class AltSvcFilter final : public proxygen::Filter {
+public:
+  AltSvcFilter(proxygen::RequestHandler* downstream, std::string value)
+      : proxygen::Filter(downstream), value_(std::move(value)) {}
+
+  void sendHeaders(proxygen::HTTPMessage& msg) noexcept override {
+    if (!msg.getHeaders().exists("Alt-Svc")) {
+      msg.getHeaders().set("Alt-Svc", value_);
+    }
+    proxygen::Filter::sendHeaders(msg);
+  }
+
+private:
+  std::string value_;
+};
+
 template <class T, class... U>
 class FilterFactory final : public proxygen::RequestHandlerFactory {
 public:
@@ -50,4 +68,12 @@ private:
 inline std::unique_ptr<proxygen::RequestHandlerFactory> trace(std::string prefix = {}) {
   return std::make_unique<FilterFactory<TraceFilter, std::string>>(std::move(prefix));
 }
+
+inline std::unique_ptr<proxygen::RequestHandlerFactory> alt_svc(
+    std::uint16_t port, std::chrono::seconds max_age = std::chrono::hours(24)
+) {
+  return std::make_unique<FilterFactory<AltSvcFilter, std::string>>(
+      "h3=\":" + std::to_string(port) + "\"; ma=" + std::to_string(max_age.count())
+  );
+}
 }  // namespace wrap::filter
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace wrap {
+namespace detail {
+template <class T>
+bool convert_param(std::string_view s, T& out) {
+  using U = std::remove_cvref_t<T>;
+  if constexpr (std::is_same_v<U, std::string>) {
+    out = std::string(s);
+    return true;
+  } else if constexpr (std::is_same_v<U, bool>) {
+    if (s == "true" || s == "1") {
+      out = true;
+      return true;
+    }
+    if (s == "false" || s == "0") {
+      out = false;
+      return true;
+    }
+    return false;
+  } else if constexpr (std::is_integral_v<U>) {
+    bool negative = false;
+    if constexpr (std::is_signed_v<U>) {
+      if (!s.empty() && s.front() == '-') {
+        negative = true;
+        s.remove_prefix(1);
+      }
+    }
+    if (s.empty()) {
+      return false;
+    }
+    std::uint64_t v = 0;
+    for (char c : s) {
+      if (c < '0' || c > '9') {
+        return false;
+      }
+      std::uint64_t d = static_cast<std::uint64_t>(c - '0');
+      if (v > (std::numeric_limits<std::uint64_t>::max() - d) / 10) {
+        return false;
+      }
+      v = v * 10 + d;
+    }
+    if constexpr (std::is_signed_v<U>) {
+      auto const limit = static_cast<std::uint64_t>(std::numeric_limits<U>::max()) + negative;
+      if (v > limit) {
+        return false;
+      }
+      out = negative && v ? static_cast<U>(-static_cast<std::int64_t>(v - 1) - 1)
+                          : static_cast<U>(v);
+    } else {
+      if (v > static_cast<std::uint64_t>(std::numeric_limits<U>::max())) {
+        return false;
+      }
+      out = static_cast<U>(v);
+    }
+    return true;
+  } else if constexpr (std::is_floating_point_v<U>) {
+    if (s.empty()) {
+      return false;
+    }
+    auto const [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+    return ec == std::errc() && ptr == s.data() + s.size();
+  } else {
+    static_assert(sizeof(T) == 0, "Unsupported param type");
+  }
+}
+
+template <std::size_t N>
+struct fixed_string {
+  constexpr fixed_string(char const (&str)[N]) { std::copy_n(str, N, value); }
+
+  constexpr std::string_view view() const { return {value, N - 1}; }
+
+  char value[N]{};
+};
+
+inline int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+}  // namespace detail
+
+// application/x-www-form-urlencoded pairs decoded once into a single arena. Lookups return
+// views into the arena, so they stay valid for as long as the Params object does.
+class Params final {
+public:
+  using Entry = std::pair<std::string_view, std::string_view>;
+
+  Params() = default;
+
+  explicit Params(std::string_view input) : arena_(std::make_unique<char[]>(input.size())) {
+    char* out = arena_.get();
+    while (!input.empty()) {
+      auto amp = input.find('&');
+      auto item = input.substr(0, amp);
+      input.remove_prefix(amp == std::string_view::npos ? input.size() : amp + 1);
+      if (item.empty()) {
+        continue;
+      }
+      auto eq = item.find('=');
+      auto name = decode(item.substr(0, eq), out);
+      auto value = eq == std::string_view::npos ? std::string_view(out, 0)
+                                                : decode(item.substr(eq + 1), out);
+      entries_.emplace_back(name, value);
+    }
+  }
+
+  std::optional<std::string_view> find(std::string_view name) const {
+    for (auto const& [k, v] : entries_) {
+      if (k == name) {
+        return v;
+      }
+    }
+    return std::nullopt;
+  }
+
+  std::vector<std::string_view> all(std::string_view name) const {
+    std::vector<std::string_view> out;
+    for (auto const& [k, v] : entries_) {
+      if (k == name) {
+        out.push_back(v);
+      }
+    }
+    return out;
+  }
+
+  template <class T>
+  std::optional<T> get(std::string_view name) const {
+    auto raw = find(name);
+    T out{};
+    if (!raw || !detail::convert_param(*raw, out)) {
+      return std::nullopt;
+    }
+    return out;
+  }
+
+  bool contains(std::string_view name) const { return find(name).has_value(); }
+
+  std::size_t size() const { return entries_.size(); }
+
+  bool empty() const { return entries_.empty(); }
+
+  auto begin() const { return entries_.begin(); }
+
+  auto end() const { return entries_.end(); }
+
+private:
+  static std::string_view decode(std::string_view in, char*& out) {
+    char* start = out;
+    for (std::size_t i = 0; i < in.size(); ++i) {
+      char c = in[i];
+      if (c == '+') {
+        c = ' ';
+      } else if (c == '%' && i + 2 < in.size()) {
+        int hi = detail::hex_value(in[i + 1]);
+        int lo = detail::hex_value(in[i + 2]);
+        if (hi >= 0 && lo >= 0) {
+          c = static_cast<char>(hi * 16 + lo);
+          i += 2;
+        }
+      }
+      *out++ = c;
+    }
+    return {start, static_cast<std::size_t>(out - start)};
+  }
+
+  std::unique_ptr<char[]> arena_;
+  std::vector<Entry> entries_;
+};
+
+// Handler arguments filled from the query string or request headers, e.g.
+// `[](Query<"limit", int> limit, Header<"X-Token"> token) { ... }`. Use std::optional<T> for
+// values that may be absent; anything missing or unconvertible otherwise yields 400.
+template <detail::fixed_string Name, class T = std::string>
+class Query final {
+public:
+  static constexpr std::string_view name() { return Name.view(); }
+
+  T const& operator*() const { return value; }
+  T const* operator->() const { return &value; }
+
+  T value{};
+};
+
+template <detail::fixed_string Name, class T = std::string>
+class Header final {
+public:
+  static constexpr std::string_view name() { return Name.view(); }
+
+  T const& operator*() const { return value; }
+  T const* operator->() const { return &value; }
+
+  T value{};
+};
+}  // namespace wrap
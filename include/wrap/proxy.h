@@ -0,0 +1,41 @@
+#pragma once
+
+#include <proxygen/httpserver/RequestHandlerFactory.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace wrap {
+enum class LoadBalance { round_robin, least_outstanding, p2c };
+
+class ProxyOptions {
+public:
+  LoadBalance balance{LoadBalance::p2c};
+  std::chrono::milliseconds connect_timeout{1000};
+  // Keep-alive upstream connections are pooled per IO thread and closed after this long idle.
+  std::chrono::milliseconds idle_timeout{60000};
+  std::size_t max_idle{32};
+  // Consecutive failures that eject an upstream, and for how long.
+  std::size_t max_failures{3};
+  std::chrono::milliseconds ejection{5000};
+  // Interval between active connect checks of every upstream, 0 to rely on request failures.
+  std::chrono::milliseconds health_interval{2000};
+  // Retries are only attempted before any of the request has been sent upstream, and go to
+  // another upstream when there is one. Each retry spends from a shared budget that every
+  // request refills by `retry_ratio`, up to `retry_burst`. Idempotent requests without a body
+  // are also sent again, outside the budget, when a pooled connection turns out to have been
+  // closed by the upstream.
+  std::size_t retries{2};
+  double retry_ratio{0.2};
+  std::size_t retry_burst{10};
+};
+
+// Forwards requests to `upstreams` ("host:port"), streaming bodies in both directions. Mount
+// it with App::mount(). Upstream connections are pooled on the server's IO threads, so requests
+// made through App::dispatch() or batch() get 503 for proxied paths.
+std::unique_ptr<proxygen::RequestHandlerFactory> proxy(
+    std::vector<std::string> upstreams, ProxyOptions options = {}
+);
+}  // namespace wrap
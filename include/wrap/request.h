@@ -3,18 +3,46 @@
 #include <folly/json/json.h>
 #include <proxygen/lib/http/HTTPMessage.h>
 
+#include <optional>
 #include <unordered_map>
 
+#include "wrap/params.h"
+#include "wrap/state.h"
+
 namespace wrap {
 class Request final {
 public:
-  Request(proxygen::HTTPMessage const* msg, folly::IOBuf* body) : msg_(msg), body_(body) {}
+  Request(proxygen::HTTPMessage const* msg, folly::IOBuf* body, detail::State* state = nullptr)
+      : msg_(msg), body_(body), state_(state) {}
   ~Request() = default;
 
   std::string getMethod() const { return msg_->getMethodString(); }
 
   std::string getURL() const { return msg_->getURL(); }
 
+  folly::SocketAddress const& getClientAddress() const { return msg_->getClientAddress(); }
+
+  proxygen::HTTPHeaders const& getHeaders() const { return msg_->getHeaders(); }
+
+  std::string getHeader(std::string const& name) const {
+    return msg_->getHeaders().getSingleOrEmpty(name);
+  }
+
+  template <class T>
+  std::optional<T> getHeader(std::string const& name) const {
+    if (!msg_->getHeaders().exists(name)) {
+      return std::nullopt;
+    }
+    T out{};
+    if (!detail::convert_param(msg_->getHeaders().getSingleOrEmpty(name), out)) {
+      return std::nullopt;
+    }
+    return out;
+  }
+
+  // True for requests received as HTTP/3 0-RTT data, which an attacker may have replayed.
+  bool isEarlyData() const { return msg_->getHeaders().getSingleOrEmpty("Early-Data") == "1"; }
+
   std::string getParam(std::string const& name) const {
     auto iter = params_.find(name);
     if (params_.end() != iter) {
@@ -26,16 +54,47 @@ public:
   void setParam(std::string const& name, std::string const& data) { params_[name] = data; }
 
   std::string getQueryParam(std::string const& name) const {
-    return msg_->getDecodedQueryParam(name);
+    return std::string(getQuery().find(name).value_or(""));
+  }
+
+  // Parsed on first use and cached for the lifetime of the request.
+  Params const& getQuery() const {
+    if (!query_) {
+      query_.emplace(msg_->getQueryStringAsStringPiece());
+    }
+    return *query_;
+  }
+
+  // Empty unless the body is application/x-www-form-urlencoded.
+  Params const& getForm() const {
+    if (!form_) {
+      folly::StringPiece type = msg_->getHeaders().getSingleOrEmpty("Content-Type");
+      if (type.startsWith("application/x-www-form-urlencoded", folly::AsciiCaseInsensitive())) {
+        form_.emplace(body());
+      } else {
+        form_.emplace();
+      }
+    }
+    return *form_;
   }
 
   std::string body() const { return body_ ? body_->toString() : std::string{}; }
 
   folly::dynamic json() const { return folly::parseJson(body()); }
 
+  // This IO thread's instance of a type registered with App::state. Null if T was not, and
+  // for requests handled off the IO threads, such as by App::dispatch().
+  template <class T>
+  T* state() const {
+    return static_cast<T*>(state_ ? state_->get(detail::state_slot<T>()) : nullptr);
+  }
+
 private:
   proxygen::HTTPMessage const* msg_;
   folly::IOBuf* body_;
+  detail::State* state_;
   std::unordered_map<std::string, std::string> params_;
+  mutable std::optional<Params> query_;
+  mutable std::optional<Params> form_;
 };
 }  // namespace wrap
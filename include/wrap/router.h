@@ -35,6 +35,18 @@ public:
     return *this;
   }
 
+  template <typename F>
+  Router& post(std::string const& path, F&& func) {
+    app_.post(join(path), std::forward<F>(func));
+    return *this;
+  }
+
+  template <typename F>
+  Router& put(std::string const& path, F&& func) {
+    app_.put(join(path), std::forward<F>(func));
+    return *this;
+  }
+
 private:
   static std::string normalize_prefix(std::string p) {
     if (p.empty()) {
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <folly/io/async/EventBase.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace wrap::detail {
+using StateFactory = std::function<std::shared_ptr<void>(folly::EventBase*)>;
+
+inline std::size_t next_state_slot() {
+  static std::atomic<std::size_t> next{0};
+  return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Process-wide index of T in every State, assigned on first use.
+template <class T>
+std::size_t state_slot() {
+  static std::size_t const slot = next_state_slot();
+  return slot;
+}
+
+// One thread's instances of the types registered with App::state, indexed by slot. Only
+// that thread touches it, so nothing here is synchronized.
+class State final {
+public:
+  State(std::vector<StateFactory> const* factories, folly::EventBase* evb)
+      : factories_(factories), evb_(evb) {}
+
+  State(State const&) = delete;
+  State& operator=(State const&) = delete;
+
+  // Reverse slot order, as with members.
+  ~State() {
+    while (!instances_.empty()) {
+      instances_.pop_back();
+    }
+  }
+
+  void start() {
+    for (std::size_t slot = 0; slot < factories_->size(); ++slot) {
+      get(slot);
+    }
+  }
+
+  // Null when nothing is registered for `slot`.
+  void* get(std::size_t slot) {
+    if (slot >= factories_->size() || !(*factories_)[slot]) {
+      return nullptr;
+    }
+    if (instances_.size() < factories_->size()) {
+      instances_.resize(factories_->size());
+    }
+    if (!instances_[slot]) {
+      instances_[slot] = (*factories_)[slot](evb_);
+    }
+    return instances_[slot].get();
+  }
+
+private:
+  std::vector<StateFactory> const* factories_;
+  folly::EventBase* evb_;
+  std::vector<std::shared_ptr<void>> instances_;
+};
+}  // namespace wrap::detail
@@ -1,11 +1,37 @@
 #include "wrap/app.h"
 
 #include <folly/String.h>
+#include <folly/Synchronized.h>
+#include <folly/io/async/AsyncTimeout.h>
+#include <folly/io/async/EventBaseManager.h>
+#include <folly/synchronization/Rcu.h>
 #include <proxygen/httpserver/RequestHandler.h>
 #include <proxygen/httpserver/RequestHandlerFactory.h>
+#include <proxygen/httpserver/ResponseHandler.h>
 #include <proxygen/httpserver/filters/DirectResponseHandler.h>
 
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "http3.h"
+#include "wrap/filter.h"
+
 namespace wrap {
+// Routes with their paths pre-split and handlers pre-wrapped in the middleware chain.
+struct App::Table {
+  struct Compiled {
+    proxygen::HTTPMethod method;
+    std::vector<std::string> segments;
+    Handler handler;
+  };
+
+  std::vector<Route> routes;
+  std::vector<Middleware> middlewares;
+  std::vector<Compiled> compiled;
+};
+
 namespace {
 static folly::StringPiece normalize(folly::StringPiece str) {
   while (str.size() > 1 && str.back() == '/') {
@@ -16,8 +42,8 @@ static folly::StringPiece normalize(folly::StringPiece str) {
 
 class RequestHandler final : public proxygen::RequestHandler {
 public:
-  explicit RequestHandler(std::vector<App::Route>* routes, std::vector<Middleware>* middlewares)
-      : routes_(routes), middlewares_(middlewares) {}
+  RequestHandler(std::atomic<App::Table const*>* table, detail::State* state)
+      : table_(table), state_(state) {}
 
   void onRequest(std::unique_ptr<proxygen::HTTPMessage> request) noexcept override {
     request_ = std::move(request);
@@ -32,16 +58,17 @@ public:
   }
 
   void onEOM() noexcept override {
-    auto request = Request(request_.get(), body_.get());
-    auto handler = getHandler(request);
+    auto request = Request(request_.get(), body_.get(), state_);
+    // The snapshot, and the handler inside it, stay alive until the guard is released, so the
+    // handler runs inside the read section. That only holds back reclaiming tables replaced in
+    // the meantime, since writers retire them rather than wait for readers, and saves copying
+    // the handler for every request.
+    std::scoped_lock guard(folly::rcu_default_domain());
+    auto const* handler = getHandler(*table_->load(std::memory_order_acquire), request);
     if (handler) {
       proxygen::ResponseBuilder builder(downstream_);
       Response response(&builder);
-      auto next = handler;
-      for (auto iter = middlewares_->rbegin(); iter != middlewares_->rend(); ++iter) {
-        next = (*iter)(std::move(next));
-      }
-      next(request, response);
+      (*handler)(request, response);
       if (builder.getHeaders() && builder.getHeaders()->getStatusCode()) {
         builder.sendWithEOM();
       } else {
@@ -65,19 +92,18 @@ public:
   void onError(proxygen::ProxygenError) noexcept override { delete this; }
 
 private:
-  Handler getHandler(Request& request) {
+  Handler const* getHandler(App::Table const& table, Request& request) {
     std::vector<folly::StringPiece> parts;
     folly::split('/', normalize(request_->getPathAsStringPiece()), parts);
-    for (auto const& route : *routes_) {
+    for (auto const& route : table.compiled) {
       if (route.method == request_->getMethod()) {
-        std::vector<folly::StringPiece> segments;
-        folly::split('/', normalize(route.path), segments);
+        auto const& segments = route.segments;
         if (parts.size() == segments.size()) {
           bool match = true;
           std::unordered_map<std::string, std::string> params;
           for (std::size_t i = 0; i < parts.size(); ++i) {
             auto lhs = parts[i];
-            auto rhs = segments[i];
+            folly::StringPiece rhs = segments[i];
             if (!rhs.empty() && rhs.front() == ':') {
               if (lhs.empty()) {
                 match = false;
@@ -136,7 +162,7 @@ private:
             for (auto& [k, v] : params) {
               request.setParam(k, v);
             }
-            return route.handler;
+            return &route.handler;
           }
         }
       }
@@ -145,50 +171,325 @@ private:
   }
 
 private:
-  std::vector<App::Route>* routes_;
-  std::vector<Middleware>* middlewares_;
+  std::atomic<App::Table const*>* table_;
+  detail::State* state_;
   std::unique_ptr<proxygen::HTTPMessage> request_;
   std::unique_ptr<folly::IOBuf> body_;
 };
 
+class FactoryRef final : public proxygen::RequestHandlerFactory {
+public:
+  explicit FactoryRef(proxygen::RequestHandlerFactory* factory) : factory_(factory) {}
+
+  void onServerStart(folly::EventBase* evb) noexcept override { factory_->onServerStart(evb); }
+
+  void onServerStop() noexcept override { factory_->onServerStop(); }
+
+  proxygen::RequestHandler* onRequest(
+      proxygen::RequestHandler* h, proxygen::HTTPMessage* msg
+  ) noexcept override {
+    return factory_->onRequest(h, msg);
+  }
+
+private:
+  proxygen::RequestHandlerFactory* factory_;
+};
+
+class LocalTransport final : public proxygen::ResponseHandler {
+public:
+  LocalTransport(proxygen::RequestHandler* upstream, LocalResponse* response)
+      : proxygen::ResponseHandler(upstream), response_(response) {}
+
+  void sendHeaders(proxygen::HTTPMessage& msg) noexcept override {
+    response_->status = msg.getStatusCode();
+    response_->message = msg.getStatusMessage();
+    response_->headers = msg.getHeaders();
+  }
+
+  void sendChunkHeader(std::size_t) noexcept override {}
+
+  void sendBody(std::unique_ptr<folly::IOBuf> body) noexcept override {
+    if (body) {
+      response_->body.append(body->toString());
+    }
+  }
+
+  void sendChunkTerminator() noexcept override {}
+
+  void sendEOM() noexcept override { eom_ = true; }
+
+  void sendAbort() noexcept override { aborted_ = true; }
+
+  void refreshTimeout() noexcept override {}
+
+  void pauseIngress() noexcept override {}
+
+  void resumeIngress() noexcept override {}
+
+  proxygen::ResponseHandler* newPushedResponse(proxygen::PushHandler*) noexcept override {
+    return nullptr;
+  }
+
+  wangle::TransportInfo const& getSetupTransportInfo() const noexcept override { return info_; }
+
+  void getCurrentTransportInfo(wangle::TransportInfo* info) const override { *info = info_; }
+
+  bool done() const { return eom_ || aborted_; }
+
+  // Anything short of a full response by now is reported upstream as an error, the same way a
+  // dropped connection would be.
+  void finish() noexcept {
+    if (eom_ && !aborted_) {
+      upstream_->requestComplete();
+    } else {
+      upstream_->onError(aborted_ ? proxygen::kErrorStreamAbort : proxygen::kErrorEOF);
+    }
+  }
+
+private:
+  LocalResponse* response_;
+  wangle::TransportInfo info_;
+  bool eom_{false};
+  bool aborted_{false};
+};
+
 class HandlerFactory final : public proxygen::RequestHandlerFactory {
 public:
-  explicit HandlerFactory(std::vector<App::Route>* routes, std::vector<Middleware>* middlewares)
-      : routes_(routes), middlewares_(middlewares) {}
+  HandlerFactory(
+      std::atomic<App::Table const*>* table, std::vector<App::Mount>* mounts,
+      folly::Synchronized<std::vector<folly::EventBase*>, std::mutex>* evbs,
+      std::condition_variable* evbs_changed,
+      std::vector<detail::StateFactory> const* state_factories,
+      folly::ThreadLocalPtr<detail::State>* state
+  )
+      : table_(table),
+        mounts_(mounts),
+        evbs_(evbs),
+        evbs_changed_(evbs_changed),
+        state_factories_(state_factories),
+        state_(state) {}
 
-  void onServerStart(folly::EventBase*) noexcept override {}
+  void onServerStart(folly::EventBase* evb) noexcept override {
+    evb_ = evb;
+    state_->reset(new detail::State(state_factories_, evb));
+    (*state_)->start();
+    for (auto& mount : *mounts_) {
+      mount.factory->onServerStart(evb);
+    }
+    evbs_->lock()->push_back(evb);
+    evbs_changed_->notify_all();
+  }
 
-  void onServerStop() noexcept override {}
+  void onServerStop() noexcept override {
+    for (auto& mount : *mounts_) {
+      mount.factory->onServerStop();
+    }
+    if (evb_) {
+      auto evbs = evbs_->lock();
+      evbs->erase(std::remove(evbs->begin(), evbs->end(), evb_), evbs->end());
+    }
+    state_->reset();
+  }
 
   proxygen::RequestHandler* onRequest(
-      proxygen::RequestHandler*, proxygen::HTTPMessage*
+      proxygen::RequestHandler*, proxygen::HTTPMessage* msg
   ) noexcept override {
-    return new RequestHandler(routes_, middlewares_);
+    if (!mounts_->empty()) {
+      auto path = msg->getPathAsStringPiece();
+      for (auto& mount : *mounts_) {
+        if (path.startsWith(mount.prefix) &&
+            (path.size() == mount.prefix.size() || path[mount.prefix.size()] == '/')) {
+          return mount.factory->onRequest(nullptr, msg);
+        }
+      }
+    }
+    // Only IO threads have a State. Elsewhere, as in dispatch() and batch sub-requests on CPU
+    // executor threads, nothing would destroy one at stop(), so Request::state<T>() is null.
+    return new RequestHandler(table_, state_->get());
   }
 
 private:
-  std::vector<App::Route>* routes_;
-  std::vector<Middleware>* middlewares_;
+  std::atomic<App::Table const*>* table_;
+  std::vector<App::Mount>* mounts_;
+  folly::Synchronized<std::vector<folly::EventBase*>, std::mutex>* evbs_;
+  std::condition_variable* evbs_changed_;
+  std::vector<detail::StateFactory> const* state_factories_;
+  folly::ThreadLocalPtr<detail::State>* state_;
+  static thread_local folly::EventBase* evb_;
 };
+
+thread_local folly::EventBase* HandlerFactory::evb_ = nullptr;
+
+App::Table const* compile(std::vector<App::Route> routes, std::vector<Middleware> middlewares) {
+  auto table = std::make_unique<App::Table>();
+  for (auto const& route : routes) {
+    std::vector<folly::StringPiece> parts;
+    folly::split('/', normalize(route.path), parts);
+    auto next = route.handler;
+    for (auto iter = middlewares.rbegin(); iter != middlewares.rend(); ++iter) {
+      next = (*iter)(std::move(next));
+    }
+    table->compiled.push_back(App::Table::Compiled{
+        route.method, std::vector<std::string>(parts.begin(), parts.end()), std::move(next)
+    });
+  }
+  table->routes = std::move(routes);
+  table->middlewares = std::move(middlewares);
+  return table.release();
+}
 }  // namespace
 
-App::App(AppOptions options) : options_(std::move(options)) {}
+App::App(AppOptions options) : options_(std::move(options)), table_(compile({}, {})) {}
 
-App& App::post(std::string const& path, Handler handler) {
-  routes_.push_back(Route{proxygen::HTTPMethod::POST, path, std::move(handler)});
+App::~App() { delete table_.load(); }
+
+App& App::use(Middleware middleware) {
+  update([&](auto&, auto& middlewares) { middlewares.push_back(std::move(middleware)); });
   return *this;
 }
 
-App& App::put(std::string const& path, Handler handler) {
-  routes_.push_back(Route{proxygen::HTTPMethod::PUT, path, std::move(handler)});
+App& App::route(proxygen::HTTPMethod method, std::string const& path, Handler handler) {
+  update([&](auto& routes, auto&) {
+    routes.push_back(Route{method, path, std::move(handler)});
+  });
+  return *this;
+}
+
+App& App::replace(proxygen::HTTPMethod method, std::string const& path, Handler handler) {
+  update([&](auto& routes, auto&) {
+    auto iter = std::find_if(routes.begin(), routes.end(), [&](auto const& route) {
+      return route.method == method && route.path == path;
+    });
+    if (iter != routes.end()) {
+      iter->handler = std::move(handler);
+    } else {
+      routes.push_back(Route{method, path, std::move(handler)});
+    }
+  });
   return *this;
 }
 
+bool App::remove(proxygen::HTTPMethod method, std::string const& path) {
+  bool removed = false;
+  update([&](auto& routes, auto&) {
+    removed = std::erase_if(routes, [&](auto const& route) {
+      return route.method == method && route.path == path;
+    }) != 0;
+  });
+  return removed;
+}
+
+App& App::post(std::string const& path, Handler handler) {
+  return route(proxygen::HTTPMethod::POST, path, std::move(handler));
+}
+
+App& App::put(std::string const& path, Handler handler) {
+  return route(proxygen::HTTPMethod::PUT, path, std::move(handler));
+}
+
 App& App::get(std::string const& path, Handler handler) {
-  routes_.push_back(Route{proxygen::HTTPMethod::GET, path, std::move(handler)});
+  return route(proxygen::HTTPMethod::GET, path, std::move(handler));
+}
+
+void App::update(
+    std::function<void(std::vector<Route>&, std::vector<Middleware>&)> const& change
+) {
+  std::lock_guard lock(mutex_);
+  if (!started_) {
+    change(routes_, middlewares_);
+    pending_.store(true, std::memory_order_release);
+    return;
+  }
+  auto const* current = table_.load(std::memory_order_acquire);
+  auto routes = current->routes;
+  auto middlewares = current->middlewares;
+  change(routes, middlewares);
+  table_.store(compile(std::move(routes), std::move(middlewares)), std::memory_order_release);
+  folly::rcu_retire(current);
+}
+
+void App::publish(bool started) {
+  std::lock_guard lock(mutex_);
+  if (pending_.load(std::memory_order_relaxed)) {
+    auto const* current = table_.load(std::memory_order_acquire);
+    table_.store(
+        started ? compile(std::move(routes_), std::move(middlewares_))
+                : compile(routes_, middlewares_),
+        std::memory_order_release
+    );
+    folly::rcu_retire(current);
+    pending_.store(false, std::memory_order_relaxed);
+  }
+  started_ = started_ || started;
+}
+
+App& App::mount(std::string prefix, std::unique_ptr<proxygen::RequestHandlerFactory> factory) {
+  while (!prefix.empty() && prefix.back() == '/') {
+    prefix.pop_back();
+  }
+  mounts_.push_back(Mount{std::move(prefix), std::move(factory)});
   return *this;
 }
 
+LocalResponse App::dispatch(
+    std::unique_ptr<proxygen::HTTPMessage> msg, std::unique_ptr<folly::IOBuf> body
+) {
+  if (pending_.load(std::memory_order_acquire)) {
+    publish(false);
+  }
+  LocalResponse response;
+  HandlerFactory factory(&table_, &mounts_, &evbs_, &evbs_changed_, &state_factories_, &state_);
+  proxygen::RequestHandler* handler = factory.onRequest(nullptr, msg.get());
+  for (auto iter = filters_.rbegin(); iter != filters_.rend(); ++iter) {
+    handler = (*iter)->onRequest(handler, msg.get());
+  }
+  LocalTransport transport(handler, &response);
+  handler->setResponseHandler(&transport);
+  handler->onRequest(std::move(msg));
+  if (body) {
+    handler->onBody(std::move(body));
+  }
+  handler->onEOM();
+  // Mounted handlers may respond later from this thread's event base. It can only be driven
+  // here when dispatch() is not itself running inside that loop. Most requests are done by
+  // now, and then the thread is left without an event base of its own.
+  if (!transport.done()) {
+    auto* evb = folly::EventBaseManager::get()->getEventBase();
+    if (!evb->isRunning()) {
+      bool expired = false;
+      auto timeout = folly::AsyncTimeout::schedule(
+          options_.dispatch_timeout, *evb, [&]() noexcept { expired = true; }
+      );
+      while (!transport.done() && !expired) {
+        evb->loopOnce();
+      }
+      if (!transport.done()) {
+        response = LocalResponse{504, "Gateway Timeout", {}, "{\"error\":\"Gateway Timeout\"}"};
+      }
+    }
+  }
+  transport.finish();
+  return response;
+}
+
+LocalResponse App::dispatch(
+    proxygen::HTTPMethod method, std::string const& url, std::string const& body
+) {
+  auto msg = std::make_unique<proxygen::HTTPMessage>();
+  msg->setMethod(method);
+  msg->setURL(url);
+  msg->setHTTPVersion(1, 1);
+  msg->setClientAddress(folly::SocketAddress("127.0.0.1", 0));
+  std::unique_ptr<folly::IOBuf> buf;
+  if (!body.empty()) {
+    msg->getHeaders().set(proxygen::HTTP_HEADER_CONTENT_LENGTH, std::to_string(body.size()));
+    buf = folly::IOBuf::copyBuffer(body);
+  }
+  return dispatch(std::move(msg), std::move(buf));
+}
+
+std::vector<folly::EventBase*> App::eventBases() const { return *evbs_.lock(); }
+
 void App::run(std::string const& host, std::uint16_t port) {
   options_.host = host;
   options_.port = port;
@@ -196,29 +497,126 @@ void App::run(std::string const& host, std::uint16_t port) {
 }
 
 void App::run() {
-  proxygen::HTTPServerOptions options;
-  options.threads = options_.threads;
+  auto fail = [this](std::exception_ptr ex) {
+    if (!ready_.isFulfilled()) {
+      ready_.setException(folly::exception_wrapper(std::move(ex)));
+    }
+  };
+  std::exception_ptr error;
+  bool serving = false;
+  try {
+    publish(true);
+
+    // One IO thread per core unless configured.
+    auto const threads =
+        options_.threads ? options_.threads : std::thread::hardware_concurrency();
+    proxygen::HTTPServerOptions options;
+    options.threads = threads;
 
-  proxygen::RequestHandlerChain chain;
-  for (auto& filter : filters_) {
-    chain.addThen(std::move(filter));
+    proxygen::RequestHandlerChain chain;
+    // An ephemeral HTTP/3 port is not known until it is bound, so it cannot be advertised.
+    if (options_.http3_port && *options_.http3_port != 0) {
+      chain.addThen(filter::alt_svc(*options_.http3_port));
+    }
+    for (auto& filter : filters_) {
+      chain.addThen<FactoryRef>(filter.get());
+    }
+    chain.addThen<HandlerFactory>(
+        &table_, &mounts_, &evbs_, &evbs_changed_, &state_factories_, &state_
+    );
+    options.handlerFactories = std::move(chain).build();
+
+    if (options_.http3_port) {
+      // Runs on the TCP server's IO threads once they have all started.
+      std::vector<proxygen::RequestHandlerFactory*> factories;
+      for (auto& filter : filters_) {
+        factories.push_back(filter.get());
+      }
+      http3_factory_ = std::make_unique<HandlerFactory>(
+          &table_, &mounts_, &evbs_, &evbs_changed_, &state_factories_, &state_
+      );
+      factories.push_back(http3_factory_.get());
+      http3_ = std::make_unique<detail::Http3Server>(
+          detail::Http3Options{options_.cert, options_.key, options_.early_data},
+          std::move(factories)
+      );
+    }
+
+    // Only records the address; the socket is bound by start(), which reports failure to
+    // its error callback after cleaning up and returns.
+    server_ = std::make_unique<proxygen::HTTPServer>(std::move(options));
+    server_->bind(
+        {{folly::SocketAddress(options_.host, options_.port, true),
+          proxygen::HTTPServer::Protocol::HTTP}}
+    );
+    {
+      std::lock_guard lock(run_mutex_);
+      main_evb_ = folly::EventBaseManager::get()->getEventBase();
+    }
+    server_->start(
+        [this, fail, threads, &error, &serving] {
+          serving = true;
+          // Each IO thread runs onServerStart from its own queue, so some may not have
+          // reported in yet when the server calls back. Waiting means per-thread state exists
+          // by ready().
+          std::vector<folly::EventBase*> evbs;
+          {
+            auto locked = evbs_.lock();
+            evbs_changed_.wait(locked.as_lock(), [&] { return locked->size() >= threads; });
+            evbs = *locked;
+          }
+          try {
+            if (http3_) {
+              http3_->start(
+                  folly::SocketAddress(options_.host, *options_.http3_port, true), evbs
+              );
+            }
+          } catch (...) {
+            // TCP clients would be told about a listener that is not there; stop serving
+            // them and return from run() with the error.
+            error = std::current_exception();
+            fail(error);
+            folly::EventBaseManager::get()->getEventBase()->terminateLoopSoon();
+            return;
+          }
+          if (!ready_.isFulfilled()) {
+            ready_.setValue(server_->addresses().front().address);
+          }
+        },
+        [&error](std::exception_ptr ex) { error = std::move(ex); }
+    );
+  } catch (...) {
+    error = std::current_exception();
   }
-  chain.addThen<HandlerFactory>(&routes_, &middlewares_);
-  options.handlerFactories = std::move(chain).build();
 
-  server_ = std::make_unique<proxygen::HTTPServer>(std::move(options));
-  server_->bind(
-      {{folly::SocketAddress(options_.host, options_.port, true),
-        proxygen::HTTPServer::Protocol::HTTP}}
-  );
-  server_->start();
-  stop();
+  // stop() only ends the main loop; everything it started is torn down here, on this thread.
+  if (http3_) {
+    http3_->stop();
+    http3_.reset();
+  }
+  if (serving) {
+    server_->stop();
+  }
+  server_.reset();
+  {
+    std::lock_guard lock(run_mutex_);
+    main_evb_ = nullptr;
+    if (error) {
+      fail(error);
+    } else {
+      fail(std::make_exception_ptr(std::runtime_error("Stopped before it started")));
+    }
+    ready_ = folly::SharedPromise<folly::SocketAddress>();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
 }
 
 void App::stop() {
-  if (server_) {
-    server_->stop();
-    server_.reset();
+  std::lock_guard lock(run_mutex_);
+  if (main_evb_) {
+    main_evb_->terminateLoopSoon();
   }
 }
 }  // namespace wrap
@@ -0,0 +1,425 @@
+#include "wrap/debug.h"
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fmt/format.h>
+#include <folly/Demangle.h>
+#include <folly/futures/Future.h>
+#include <folly/io/async/AsyncTimeout.h>
+#include <folly/io/async/EventBaseManager.h>
+#include <folly/memory/Malloc.h>
+#include <malloc.h>
+#include <proxygen/httpserver/RequestHandler.h>
+#include <proxygen/httpserver/RequestHandlerFactory.h>
+#include <proxygen/httpserver/ResponseBuilder.h>
+#include <proxygen/httpserver/filters/DirectResponseHandler.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace wrap::debug {
+namespace {
+constexpr std::size_t max_frames = 48;
+constexpr std::size_t max_samples = 1 << 15;
+// on_sigprof and the signal trampoline.
+constexpr int skip_frames = 2;
+
+struct Sample {
+  int depth;
+  void* frames[max_frames];
+};
+
+std::atomic<Sample*> active_samples{nullptr};
+std::atomic<std::size_t> next_sample{0};
+std::atomic<int> running_handlers{0};
+
+void on_sigprof(int, siginfo_t*, void*) {
+  int const saved = errno;
+  running_handlers.fetch_add(1, std::memory_order_acquire);
+  if (auto* samples = active_samples.load(std::memory_order_acquire)) {
+    auto i = next_sample.fetch_add(1, std::memory_order_relaxed);
+    if (i < max_samples) {
+      samples[i].depth = backtrace(samples[i].frames, max_frames);
+    }
+  }
+  running_handlers.fetch_sub(1, std::memory_order_release);
+  errno = saved;
+}
+
+std::string symbolize(void* addr, std::unordered_map<void*, std::string>& cache) {
+  auto iter = cache.find(addr);
+  if (iter != cache.end()) {
+    return iter->second;
+  }
+  std::string name;
+  Dl_info info;
+  if (dladdr(addr, &info) && info.dli_sname) {
+    name = folly::demangle(info.dli_sname).toStdString();
+  } else {
+    name = fmt::format("{}", addr);
+  }
+  // ';' separates frames in the folded format.
+  std::replace(name.begin(), name.end(), ';', ':');
+  return cache.emplace(addr, std::move(name)).first->second;
+}
+
+std::atomic<bool> profiling{false};
+
+// Stays installed once set: a SIGPROF still pending when a profile stops must not fall
+// through to the default action, which terminates the process. With no buffer active the
+// handler does nothing.
+void install_sigprof() {
+  static std::once_flag once;
+  std::call_once(once, [] {
+    struct sigaction action {};
+    action.sa_sigaction = on_sigprof;
+    action.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+  });
+}
+
+// Starts sampling every thread's CPU time with SIGPROF, or returns null if a profile is
+// already in progress.
+std::unique_ptr<Sample[]> start_profile(int hz) {
+  if (profiling.exchange(true, std::memory_order_acquire)) {
+    return nullptr;
+  }
+
+  // backtrace() loads libgcc on first use, which is not safe inside a signal handler.
+  void* warmup[1];
+  backtrace(warmup, 1);
+  install_sigprof();
+
+  auto samples = std::make_unique_for_overwrite<Sample[]>(max_samples);
+  next_sample.store(0, std::memory_order_relaxed);
+  active_samples.store(samples.get(), std::memory_order_release);
+
+  auto const interval = 1000000 / hz;
+  itimerval timer{};
+  timer.it_interval.tv_sec = interval / 1000000;
+  timer.it_interval.tv_usec = interval % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, nullptr);
+  return samples;
+}
+
+// Stops sampling and returns folded stacks, one "root;...;leaf count" line per unique stack,
+// as consumed by flamegraph.pl and pprof.
+std::string stop_profile(std::unique_ptr<Sample[]> samples) {
+  itimerval timer{};
+  setitimer(ITIMER_PROF, &timer, nullptr);
+  active_samples.store(nullptr, std::memory_order_release);
+  while (running_handlers.load(std::memory_order_acquire) != 0) {
+    std::this_thread::yield();
+  }
+
+  std::map<std::vector<void*>, std::size_t> stacks;
+  auto const count = std::min(next_sample.load(std::memory_order_relaxed), max_samples);
+  for (std::size_t i = 0; i < count; ++i) {
+    auto const& sample = samples[i];
+    if (sample.depth > skip_frames) {
+      ++stacks[std::vector<void*>(sample.frames + skip_frames, sample.frames + sample.depth)];
+    }
+  }
+  profiling.store(false, std::memory_order_release);
+
+  std::string out;
+  std::unordered_map<void*, std::string> cache;
+  for (auto const& [frames, n] : stacks) {
+    for (auto iter = frames.rbegin(); iter != frames.rend(); ++iter) {
+      if (iter != frames.rbegin()) {
+        out.push_back(';');
+      }
+      out.append(symbolize(*iter, cache));
+    }
+    out.append(fmt::format(" {}\n", n));
+  }
+  return out;
+}
+
+folly::dynamic heap_stats() {
+  folly::dynamic out = folly::dynamic::object;
+  if (folly::usingJEMalloc()) {
+    out["allocator"] = "jemalloc";
+    std::uint64_t epoch = 1;
+    std::size_t len = sizeof(epoch);
+    mallctl("epoch", &epoch, &len, &epoch, len);
+    for (auto const* name :
+         {"allocated", "active", "metadata", "resident", "mapped", "retained"}) {
+      std::size_t value = 0;
+      len = sizeof(value);
+      if (mallctl(fmt::format("stats.{}", name).c_str(), &value, &len, nullptr, 0) == 0) {
+        out[name] = static_cast<std::int64_t>(value);
+      }
+    }
+    return out;
+  }
+#if defined(__GLIBC__)
+  auto const info = mallinfo2();
+  out["allocator"] = "glibc";
+  out["arena"] = static_cast<std::int64_t>(info.arena);
+  out["mmap"] = static_cast<std::int64_t>(info.hblkhd);
+  out["allocated"] = static_cast<std::int64_t>(info.uordblks);
+  out["free"] = static_cast<std::int64_t>(info.fordblks);
+#else
+  out["allocator"] = "unknown";
+#endif
+  return out;
+}
+
+// Lag is the time a callback queued on the loop waits before it runs. Every loop is probed,
+// the caller's included, and one that does not answer within `timeout` reports null.
+folly::SemiFuture<folly::dynamic> loop_stats(
+    std::vector<folly::EventBase*> const& evbs, std::chrono::milliseconds timeout
+) {
+  using Clock = std::chrono::steady_clock;
+  struct Probe {
+    Clock::duration lag;
+    double avg_loop_us;
+  };
+  auto const start = Clock::now();
+  std::vector<std::int64_t> depths;
+  std::vector<folly::SemiFuture<Probe>> probes;
+  for (auto* evb : evbs) {
+    depths.push_back(static_cast<std::int64_t>(evb->getNotificationQueueSize()));
+    auto [promise, future] = folly::makePromiseContract<Probe>();
+    evb->runInEventBaseThread([promise = std::move(promise), evb, start]() mutable {
+      promise.setValue(Probe{Clock::now() - start, evb->getAvgLoopTime()});
+    });
+    probes.push_back(std::move(future).within(timeout));
+  }
+  return folly::collectAll(std::move(probes))
+      .deferValue([depths = std::move(depths)](std::vector<folly::Try<Probe>> results) {
+        folly::dynamic out = folly::dynamic::array;
+        for (std::size_t i = 0; i < results.size(); ++i) {
+          folly::dynamic loop = folly::dynamic::object("index", static_cast<std::int64_t>(i))(
+              "queue_depth", depths[i]
+          );
+          if (results[i].hasValue()) {
+            auto const& probe = results[i].value();
+            loop["avg_loop_us"] = probe.avg_loop_us;
+            loop["lag_us"] = static_cast<std::int64_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(probe.lag).count()
+            );
+          } else {
+            loop["avg_loop_us"] = nullptr;
+            loop["lag_us"] = nullptr;
+          }
+          out.push_back(std::move(loop));
+        }
+        return out;
+      });
+}
+
+bool allowed(Request const& req, Options const& options) {
+  if (options.loopback_only) {
+    auto const& addr = req.getClientAddress();
+    if (!addr.isInitialized() || !addr.isLoopbackAddress()) {
+      return false;
+    }
+  }
+  if (!options.token.empty()) {
+    auto const expected = "Bearer " + options.token;
+    auto const actual = req.getHeader("Authorization");
+    if (actual.size() != expected.size()) {
+      return false;
+    }
+    unsigned char diff = 0;
+    for (std::size_t i = 0; i < actual.size(); ++i) {
+      diff |= static_cast<unsigned char>(actual[i] ^ expected[i]);
+    }
+    return diff == 0;
+  }
+  return true;
+}
+
+Handler guarded(Options const& options, Handler handler) {
+  return [options, handler = std::move(handler)](Request const& req, Response& res) {
+    if (!allowed(req, options)) {
+      detail::send_error(res, 403, "Forbidden");
+      return;
+    }
+    handler(req, res);
+  };
+}
+
+// Responds once the profile's duration has elapsed on the request's event base, which keeps
+// serving its other connections meanwhile.
+class ProfileHandler final : public proxygen::RequestHandler, private folly::AsyncTimeout {
+public:
+  explicit ProfileHandler(Options const& options) : options_(options) {}
+
+  void onRequest(std::unique_ptr<proxygen::HTTPMessage> request) noexcept override {
+    request_ = std::move(request);
+  }
+
+  void onBody(std::unique_ptr<folly::IOBuf>) noexcept override {}
+
+  void onEOM() noexcept override {
+    auto const req = Request(request_.get(), nullptr);
+    if (!allowed(req, options_)) {
+      send(403, "Forbidden");
+      return;
+    }
+    auto const& query = req.getQuery();
+    auto const seconds = std::min<std::int64_t>(
+        query.get<std::int64_t>("seconds").value_or(10), options_.max_duration.count()
+    );
+    auto const hz = std::clamp(query.get<int>("hz").value_or(99), 1, 1000);
+    if (seconds <= 0) {
+      send(400, "Invalid duration");
+      return;
+    }
+    samples_ = start_profile(hz);
+    if (!samples_) {
+      send(409, "A profile is already in progress");
+      return;
+    }
+    attachEventBase(folly::EventBaseManager::get()->getEventBase());
+    scheduleTimeout(std::chrono::milliseconds(std::chrono::seconds(seconds)));
+  }
+
+  void onUpgrade(proxygen::UpgradeProtocol) noexcept override {}
+
+  void requestComplete() noexcept override { delete this; }
+
+  void onError(proxygen::ProxygenError) noexcept override {
+    if (samples_) {
+      cancelTimeout();
+      stop_profile(std::move(samples_));
+    }
+    delete this;
+  }
+
+private:
+  void timeoutExpired() noexcept override {
+    auto out = stop_profile(std::move(samples_));
+    proxygen::ResponseBuilder(downstream_)
+        .status(200, "OK")
+        .header("Content-Type", "text/plain; charset=utf-8")
+        .body(out)
+        .sendWithEOM();
+  }
+
+  void send(std::uint16_t code, std::string const& message) {
+    proxygen::ResponseBuilder builder(downstream_);
+    Response response(&builder);
+    detail::send_error(response, code, message);
+    builder.sendWithEOM();
+  }
+
+  Options options_;
+  std::unique_ptr<proxygen::HTTPMessage> request_;
+  std::unique_ptr<Sample[]> samples_;
+};
+
+// Responds from the request's event base once every loop has answered its probe, so this
+// loop is probed like the others instead of waiting on them.
+class LoopsHandler final : public proxygen::RequestHandler {
+public:
+  LoopsHandler(App& app, Options const& options) : app_(app), options_(options) {}
+
+  void onRequest(std::unique_ptr<proxygen::HTTPMessage> request) noexcept override {
+    request_ = std::move(request);
+  }
+
+  void onBody(std::unique_ptr<folly::IOBuf>) noexcept override {}
+
+  void onEOM() noexcept override {
+    if (!allowed(Request(request_.get(), nullptr), options_)) {
+      send(403, "Forbidden", nullptr);
+      return;
+    }
+    pending_ = true;
+    loop_stats(app_.eventBases(), std::chrono::seconds(1))
+        .via(folly::getKeepAliveToken(folly::EventBaseManager::get()->getEventBase()))
+        .thenValue([this](folly::dynamic out) {
+          pending_ = false;
+          if (aborted_) {
+            delete this;
+            return;
+          }
+          send(200, "OK", std::move(out));
+        });
+  }
+
+  void onUpgrade(proxygen::UpgradeProtocol) noexcept override {}
+
+  void requestComplete() noexcept override { delete this; }
+
+  void onError(proxygen::ProxygenError) noexcept override {
+    if (pending_) {
+      aborted_ = true;
+    } else {
+      delete this;
+    }
+  }
+
+private:
+  void send(std::uint16_t code, std::string const& message, folly::dynamic body) {
+    proxygen::ResponseBuilder builder(downstream_);
+    Response response(&builder);
+    if (code == 200) {
+      detail::send_json(response, code, message, body);
+    } else {
+      detail::send_error(response, code, message);
+    }
+    builder.sendWithEOM();
+  }
+
+  App& app_;
+  Options options_;
+  std::unique_ptr<proxygen::HTTPMessage> request_;
+  bool pending_{false};
+  bool aborted_{false};
+};
+
+// Builds a handler per GET request and answers other methods with 405.
+class GetFactory final : public proxygen::RequestHandlerFactory {
+public:
+  explicit GetFactory(std::function<proxygen::RequestHandler*()> make) : make_(std::move(make)) {}
+
+  void onServerStart(folly::EventBase*) noexcept override {}
+
+  void onServerStop() noexcept override {}
+
+  proxygen::RequestHandler* onRequest(
+      proxygen::RequestHandler*, proxygen::HTTPMessage* msg
+  ) noexcept override {
+    if (msg->getMethod() != proxygen::HTTPMethod::GET) {
+      return new proxygen::DirectResponseHandler(405, "Method Not Allowed", "");
+    }
+    return make_();
+  }
+
+private:
+  std::function<proxygen::RequestHandler*()> make_;
+};
+}  // namespace
+
+void install(App& app, Options options) {
+  auto heap = [](Request const&, Response& res) {
+    detail::send_json(res, 200, "OK", heap_stats());
+  };
+
+  app.mount(
+      options.prefix + "/pprof/profile",
+      std::make_unique<GetFactory>([options] { return new ProfileHandler(options); })
+  );
+  app.mount(
+      options.prefix + "/loops",
+      std::make_unique<GetFactory>([&app, options] { return new LoopsHandler(app, options); })
+  );
+  app.get(options.prefix + "/pprof/heap", guarded(options, std::move(heap)));
+}
+}  // namespace wrap::debug
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <proxygen/lib/http/HTTPMessage.h>
+
+namespace wrap::detail {
+// Whether sending `msg` twice has the same effect as sending it once (RFC 9110, 9.2.2). A
+// message without a known method is treated as unsafe.
+inline bool idempotent(proxygen::HTTPMessage const& msg) {
+  switch (msg.getMethod().value_or(proxygen::HTTPMethod::POST)) {
+    case proxygen::HTTPMethod::GET:
+    case proxygen::HTTPMethod::HEAD:
+    case proxygen::HTTPMethod::OPTIONS:
+    case proxygen::HTTPMethod::TRACE:
+    case proxygen::HTTPMethod::PUT:
+    case proxygen::HTTPMethod::DELETE:
+      return true;
+    default:
+      return false;
+  }
+}
+}  // namespace wrap::detail
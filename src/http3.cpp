@@ -0,0 +1,230 @@
+#include "http3.h"
+
+#include <stdexcept>
+
+#if WRAP_HAS_HTTP3
+#include <fizz/server/AeadTicketCipher.h>
+#include <fizz/server/CertManager.h>
+#include <fizz/server/FizzServerContext.h>
+#include <fizz/server/SlidingBloomReplayCache.h>
+#include <folly/FileUtil.h>
+#include <folly/Random.h>
+#include <proxygen/httpserver/RequestHandler.h>
+#include <proxygen/httpserver/RequestHandlerAdaptor.h>
+#include <proxygen/httpserver/filters/DirectResponseHandler.h>
+#include <proxygen/lib/http/session/HQDownstreamSession.h>
+#include <quic/server/QuicServer.h>
+#include <quic/server/QuicServerTransport.h>
+#include <quic/server/QuicServerTransportFactory.h>
+
+#include <array>
+#include <chrono>
+
+#include "http.h"
+#endif
+
+namespace wrap::detail {
+#if WRAP_HAS_HTTP3
+namespace {
+constexpr auto transaction_timeout = std::chrono::seconds(60);
+// 0-RTT is accepted within this much clock skew, and the replay cache covers twice that.
+constexpr auto early_data_skew = std::chrono::seconds(10);
+
+// One per session, deleted when the session detaches.
+class SessionController final : public proxygen::HTTPSessionController {
+public:
+  explicit SessionController(std::vector<proxygen::RequestHandlerFactory*> const* factories)
+      : factories_(factories) {}
+
+  proxygen::HQDownstreamSession* createSession() {
+    wangle::TransportInfo info;
+    session_ = new proxygen::HQDownstreamSession(transaction_timeout, this, info, nullptr);
+    return session_;
+  }
+
+  void startSession(std::shared_ptr<quic::QuicSocket> socket) {
+    session_->setSocket(std::move(socket));
+    session_->startNow();
+  }
+
+  proxygen::HTTPTransactionHandler* getRequestHandler(
+      proxygen::HTTPTransaction& txn, proxygen::HTTPMessage* msg
+  ) override {
+    // Requests sent as 0-RTT data may be replays. Those that are not idempotent are told to
+    // retry after the handshake (RFC 8470); the rest carry Early-Data for Request::isEarlyData.
+    msg->getHeaders().remove("Early-Data");
+    if (!txn.isReplaySafe()) {
+      if (!idempotent(*msg)) {
+        return new proxygen::RequestHandlerAdaptor(
+            new proxygen::DirectResponseHandler(425, "Too Early", "")
+        );
+      }
+      msg->getHeaders().set("Early-Data", "1");
+    }
+    proxygen::RequestHandler* handler = nullptr;
+    for (auto iter = factories_->rbegin(); iter != factories_->rend(); ++iter) {
+      handler = (*iter)->onRequest(handler, msg);
+    }
+    return new proxygen::RequestHandlerAdaptor(handler);
+  }
+
+  proxygen::HTTPTransactionHandler* getParseErrorHandler(
+      proxygen::HTTPTransaction*, proxygen::HTTPException const&, folly::SocketAddress const&
+  ) override {
+    return new proxygen::RequestHandlerAdaptor(
+        new proxygen::DirectResponseHandler(400, "Bad Request", "")
+    );
+  }
+
+  proxygen::HTTPTransactionHandler* getTransactionTimeoutHandler(
+      proxygen::HTTPTransaction*, folly::SocketAddress const&
+  ) override {
+    return new proxygen::RequestHandlerAdaptor(
+        new proxygen::DirectResponseHandler(408, "Request Timeout", "")
+    );
+  }
+
+  void attachSession(proxygen::HTTPSessionBase*) override {}
+
+  void detachSession(proxygen::HTTPSessionBase const*) override { delete this; }
+
+private:
+  std::vector<proxygen::RequestHandlerFactory*> const* factories_;
+  proxygen::HQDownstreamSession* session_{nullptr};
+};
+
+class TransportFactory final : public quic::QuicServerTransportFactory {
+public:
+  explicit TransportFactory(std::vector<proxygen::RequestHandlerFactory*> const* factories)
+      : factories_(factories) {}
+
+  quic::QuicServerTransport::Ptr make(
+      folly::EventBase* evb, std::unique_ptr<quic::FollyAsyncUDPSocket> socket,
+      folly::SocketAddress const&, quic::QuicVersion,
+      std::shared_ptr<fizz::server::FizzServerContext const> ctx
+  ) noexcept override {
+    auto controller = std::make_unique<SessionController>(factories_);
+    auto* session = controller->createSession();
+    auto transport =
+        quic::QuicServerTransport::make(evb, std::move(socket), session, session, std::move(ctx));
+    controller.release()->startSession(transport);
+    return transport;
+  }
+
+private:
+  std::vector<proxygen::RequestHandlerFactory*> const* factories_;
+};
+
+std::shared_ptr<fizz::server::FizzServerContext> make_context(Http3Options const& options) {
+  std::string cert;
+  std::string key;
+  if (!folly::readFile(options.cert.c_str(), cert) ||
+      !folly::readFile(options.key.c_str(), key)) {
+    throw std::runtime_error("Failed to read HTTP/3 certificate or key");
+  }
+  auto certs = std::make_shared<fizz::server::CertManager>();
+  certs->addCert(fizz::CertUtils::makeSelfCert(std::move(cert), std::move(key)), true);
+
+  auto ctx = std::make_shared<fizz::server::FizzServerContext>();
+  ctx->setCertManager(certs);
+  ctx->setSupportedAlpns({"h3"});
+  ctx->setAlpnMode(fizz::server::AlpnMode::Required);
+  ctx->setClientAuthMode(fizz::server::ClientAuthMode::None);
+  // The QUIC transport issues session tickets itself.
+  ctx->setSendNewSessionTicket(false);
+
+  // Tickets are only valid for the life of the process; resumption and 0-RTT need them.
+  std::array<std::uint8_t, 32> secret;
+  folly::Random::secureRandom(secret.data(), secret.size());
+  auto cipher = std::make_shared<fizz::server::AES128TicketCipher>(ctx->getFactoryPtr(), certs);
+  cipher->setTicketSecrets({folly::range(secret)});
+  ctx->setTicketCipher(std::move(cipher));
+  return ctx;
+}
+}  // namespace
+
+class Http3Server::Impl {
+public:
+  Impl(Http3Options options, std::vector<proxygen::RequestHandlerFactory*> factories)
+      : options_(std::move(options)),
+        factories_(std::move(factories)),
+        ctx_(make_context(options_)) {}
+
+  void start(folly::SocketAddress const& address, std::vector<folly::EventBase*> const& evbs) {
+    quic::TransportSettings settings;
+    if (options_.early_data) {
+      settings.zeroRttSourceTokenMatchingPolicy =
+          quic::ZeroRttSourceTokenMatchingPolicy::LIMIT_IF_NO_EXACT_MATCH;
+      // Rejects 0-RTT whose ClientHello was already seen, so captured early data cannot be
+      // replayed wholesale. Its cleanup runs on the first IO thread.
+      fizz::server::ClockSkewTolerance tolerance;
+      tolerance.before = -early_data_skew;
+      tolerance.after = early_data_skew;
+      ctx_->setEarlyDataSettings(
+          true, tolerance,
+          std::make_shared<fizz::server::SlidingBloomReplayCache>(
+              2 * early_data_skew.count(), 10000, 0.0001, evbs.front()
+          )
+      );
+    }
+    server_ = quic::QuicServer::createQuicServer();
+    server_->setTransportSettings(settings);
+    server_->setQuicServerTransportFactory(std::make_unique<TransportFactory>(&factories_));
+    server_->setFizzContext(ctx_);
+    server_->setEarlyDataAppParamsFunctions(
+        [](auto const& alpn, auto const&) { return alpn && *alpn == "h3"; },
+        [] { return std::unique_ptr<folly::IOBuf>(); }
+    );
+    server_->initialize(address, evbs, true);
+    server_->start();
+    server_->waitUntilInitialized();
+  }
+
+  void stop() {
+    if (server_) {
+      server_->shutdown();
+      server_.reset();
+    }
+  }
+
+  folly::SocketAddress address() const { return server_->getAddress(); }
+
+private:
+  Http3Options options_;
+  std::vector<proxygen::RequestHandlerFactory*> factories_;
+  std::shared_ptr<fizz::server::FizzServerContext> ctx_;
+  std::shared_ptr<quic::QuicServer> server_;
+};
+
+Http3Server::Http3Server(
+    Http3Options options, std::vector<proxygen::RequestHandlerFactory*> factories
+)
+    : impl_(std::make_unique<Impl>(std::move(options), std::move(factories))) {}
+
+Http3Server::~Http3Server() { stop(); }
+
+void Http3Server::start(
+    folly::SocketAddress const& address, std::vector<folly::EventBase*> const& evbs
+) {
+  impl_->start(address, evbs);
+}
+
+void Http3Server::stop() { impl_->stop(); }
+
+folly::SocketAddress Http3Server::address() const { return impl_->address(); }
+#else
+class Http3Server::Impl {};
+
+Http3Server::Http3Server(Http3Options, std::vector<proxygen::RequestHandlerFactory*>) {
+  throw std::runtime_error("HTTP/3 support is not enabled in this build");
+}
+
+Http3Server::~Http3Server() = default;
+
+void Http3Server::start(folly::SocketAddress const&, std::vector<folly::EventBase*> const&) {}
+
+void Http3Server::stop() {}
+
+folly::SocketAddress Http3Server::address() const { return {}; }
+#endif
+}  // namespace wrap::detail
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <folly/SocketAddress.h>
+#include <folly/io/async/EventBase.h>
+#include <proxygen/httpserver/RequestHandlerFactory.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace wrap::detail {
+class Http3Options {
+public:
+  std::string cert;
+  std::string key;
+  bool early_data{false};
+};
+
+// HTTP/3 listener that runs on the TCP server's IO threads, so handler factories see the
+// same event bases, and builds each request's handler from `factories` in order.
+class Http3Server final {
+public:
+  Http3Server(Http3Options options, std::vector<proxygen::RequestHandlerFactory*> factories);
+  ~Http3Server();
+
+  void start(folly::SocketAddress const& address, std::vector<folly::EventBase*> const& evbs);
+  void stop();
+
+  folly::SocketAddress address() const;
+
+private:
+  class Impl;
+  std::unique_ptr<Impl> impl_;
+};
+}  // namespace wrap::detail
@@ -0,0 +1,643 @@
+#include "wrap/proxy.h"
+
+#include <folly/Random.h>
+#include <folly/SocketAddress.h>
+#include <folly/ThreadLocal.h>
+#include <folly/io/IOBufQueue.h>
+#include <folly/io/async/AsyncTimeout.h>
+#include <folly/io/async/EventBase.h>
+#include <proxygen/httpserver/RequestHandler.h>
+#include <proxygen/httpserver/ResponseBuilder.h>
+#include <proxygen/lib/http/HTTPConnector.h>
+#include <proxygen/lib/http/session/HTTPTransaction.h>
+#include <proxygen/lib/http/session/HTTPUpstreamSession.h>
+#include <proxygen/lib/utils/WheelTimerInstance.h>
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <unordered_set>
+
+#include "http.h"
+
+namespace wrap {
+namespace {
+std::int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()
+  )
+      .count();
+}
+
+struct Upstream {
+  explicit Upstream(std::string const& hostport) { address.setFromHostPort(hostport); }
+
+  folly::SocketAddress address;
+  std::atomic<std::int64_t> outstanding{0};
+  std::atomic<std::size_t> failures{0};
+  std::atomic<std::int64_t> ejected_until{0};
+};
+
+// Upstream health, load and the retry budget, shared by every IO thread.
+class Cluster final {
+public:
+  static constexpr std::size_t none = std::numeric_limits<std::size_t>::max();
+
+  Cluster(std::vector<std::string> const& upstreams, ProxyOptions options)
+      : options_(std::move(options)),
+        budget_(static_cast<std::int64_t>(options_.retry_burst) * 1000) {
+    for (auto const& upstream : upstreams) {
+      upstreams_.push_back(std::make_unique<Upstream>(upstream));
+    }
+  }
+
+  ProxyOptions const& options() const { return options_; }
+
+  std::size_t size() const { return upstreams_.size(); }
+
+  Upstream& at(std::size_t i) { return *upstreams_[i]; }
+
+  // Passes over `exclude`, the upstream a retry is moving away from, unless it is the only one.
+  std::size_t pick(std::size_t exclude = none) {
+    auto const n = upstreams_.size();
+    if (n == 0) {
+      return none;
+    }
+    if (n == 1) {
+      exclude = none;
+    }
+    auto const now = now_ns();
+    auto healthy = [&](std::size_t i) {
+      return i != exclude && upstreams_[i]->ejected_until.load(std::memory_order_relaxed) <= now;
+    };
+    auto load = [&](std::size_t i) {
+      return upstreams_[i]->outstanding.load(std::memory_order_relaxed);
+    };
+    switch (options_.balance) {
+      case LoadBalance::round_robin:
+        for (std::size_t k = 0; k < n; ++k) {
+          auto const i = next_.fetch_add(1, std::memory_order_relaxed) % n;
+          if (healthy(i)) {
+            return i;
+          }
+        }
+        break;
+      case LoadBalance::least_outstanding: {
+        auto best = none;
+        for (std::size_t i = 0; i < n; ++i) {
+          if (healthy(i) && (best == none || load(i) < load(best))) {
+            best = i;
+          }
+        }
+        if (best != none) {
+          return best;
+        }
+        break;
+      }
+      case LoadBalance::p2c: {
+        std::size_t const a = folly::Random::rand32(n);
+        std::size_t const b = n > 1 ? (a + 1 + folly::Random::rand32(n - 1)) % n : a;
+        if (healthy(a) && healthy(b)) {
+          return load(a) <= load(b) ? a : b;
+        }
+        if (healthy(a) || healthy(b)) {
+          return healthy(a) ? a : b;
+        }
+        for (std::size_t i = 0; i < n; ++i) {
+          if (healthy(i)) {
+            return i;
+          }
+        }
+        break;
+      }
+    }
+    // Every upstream is ejected. Spreading requests over all of them beats failing them all.
+    auto const i = next_.fetch_add(1, std::memory_order_relaxed) % n;
+    return i == exclude ? (i + 1) % n : i;
+  }
+
+  void succeeded(std::size_t i) {
+    upstreams_[i]->failures.store(0, std::memory_order_relaxed);
+    upstreams_[i]->ejected_until.store(0, std::memory_order_relaxed);
+  }
+
+  void failed(std::size_t i) {
+    if (upstreams_[i]->failures.fetch_add(1, std::memory_order_relaxed) + 1 >=
+        options_.max_failures) {
+      auto const ejection =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(options_.ejection).count();
+      upstreams_[i]->ejected_until.store(now_ns() + ejection, std::memory_order_relaxed);
+    }
+  }
+
+  // The budget is kept in thousandths of a retry.
+  void deposit() {
+    auto const cap = static_cast<std::int64_t>(options_.retry_burst) * 1000;
+    auto const earned = static_cast<std::int64_t>(options_.retry_ratio * 1000);
+    auto tokens = budget_.load(std::memory_order_relaxed);
+    while (tokens < cap && !budget_.compare_exchange_weak(
+                               tokens, std::min(cap, tokens + earned), std::memory_order_relaxed
+                           )) {
+    }
+  }
+
+  bool withdraw() {
+    auto tokens = budget_.load(std::memory_order_relaxed);
+    while (tokens >= 1000) {
+      if (budget_.compare_exchange_weak(tokens, tokens - 1000, std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool claimHealthCheck() { return !checking_.exchange(true); }
+
+  void releaseHealthCheck() { checking_.store(false); }
+
+private:
+  ProxyOptions options_;
+  std::vector<std::unique_ptr<Upstream>> upstreams_;
+  std::atomic<std::size_t> next_{0};
+  std::atomic<std::int64_t> budget_;
+  std::atomic<bool> checking_{false};
+};
+
+// Connects to one upstream and reports the outcome, then deletes itself.
+class Probe final : private proxygen::HTTPConnector::Callback {
+public:
+  static void start(
+      folly::EventBase* evb, proxygen::WheelTimerInstance const& timer,
+      std::shared_ptr<Cluster> cluster, std::size_t upstream
+  ) {
+    auto* probe = new Probe(timer, std::move(cluster), upstream);
+    probe->connector_.connect(
+        evb, probe->cluster_->at(upstream).address, probe->cluster_->options().connect_timeout
+    );
+  }
+
+private:
+  Probe(
+      proxygen::WheelTimerInstance const& timer, std::shared_ptr<Cluster> cluster,
+      std::size_t upstream
+  )
+      : cluster_(std::move(cluster)), upstream_(upstream), connector_(this, timer) {}
+
+  void connectSuccess(proxygen::HTTPUpstreamSession* session) override {
+    session->dropConnection();
+    cluster_->succeeded(upstream_);
+    delete this;
+  }
+
+  void connectError(folly::AsyncSocketException const&) override {
+    cluster_->failed(upstream_);
+    delete this;
+  }
+
+  std::shared_ptr<Cluster> cluster_;
+  std::size_t upstream_;
+  proxygen::HTTPConnector connector_;
+};
+
+class HealthCheck final : public folly::AsyncTimeout {
+public:
+  HealthCheck(
+      folly::EventBase* evb, proxygen::WheelTimerInstance timer, std::shared_ptr<Cluster> cluster
+  )
+      : folly::AsyncTimeout(evb),
+        evb_(evb),
+        timer_(std::move(timer)),
+        cluster_(std::move(cluster)) {
+    scheduleTimeout(cluster_->options().health_interval);
+  }
+
+  void timeoutExpired() noexcept override {
+    for (std::size_t i = 0; i < cluster_->size(); ++i) {
+      Probe::start(evb_, timer_, cluster_, i);
+    }
+    scheduleTimeout(cluster_->options().health_interval);
+  }
+
+private:
+  folly::EventBase* evb_;
+  proxygen::WheelTimerInstance timer_;
+  std::shared_ptr<Cluster> cluster_;
+};
+
+// Keep-alive upstream sessions owned by one IO thread.
+class Pool final : public proxygen::HTTPSessionBase::InfoCallback {
+public:
+  Pool(folly::EventBase* evb, std::shared_ptr<Cluster> cluster)
+      : evb_(evb),
+        cluster_(std::move(cluster)),
+        timer_(cluster_->options().idle_timeout, evb),
+        idle_(cluster_->size()) {
+    if (cluster_->options().health_interval.count() > 0 && cluster_->claimHealthCheck()) {
+      health_ = std::make_unique<HealthCheck>(evb_, timer_, cluster_);
+    }
+  }
+
+  ~Pool() override { shutdown(); }
+
+  folly::EventBase* evb() const { return evb_; }
+
+  proxygen::WheelTimerInstance const& timer() const { return timer_; }
+
+  Cluster& cluster() { return *cluster_; }
+
+  proxygen::HTTPUpstreamSession* acquire(std::size_t upstream) {
+    auto& idle = idle_[upstream];
+    while (!idle.empty()) {
+      auto* session = idle.back();
+      idle.pop_back();
+      if (session->isReusable() && !session->isClosing()) {
+        return session;
+      }
+    }
+    return nullptr;
+  }
+
+  void add(proxygen::HTTPUpstreamSession* session) {
+    session->setInfoCallback(this);
+    sessions_.insert(session);
+  }
+
+  void release(std::size_t upstream, proxygen::HTTPUpstreamSession* session) {
+    if (!sessions_.contains(session)) {
+      return;
+    }
+    if (stopped_ || !session->isReusable() ||
+        idle_[upstream].size() >= cluster_->options().max_idle) {
+      session->closeWhenIdle();
+      return;
+    }
+    idle_[upstream].push_back(session);
+  }
+
+  void shutdown() {
+    if (stopped_) {
+      return;
+    }
+    stopped_ = true;
+    if (health_) {
+      health_.reset();
+      cluster_->releaseHealthCheck();
+    }
+    for (auto& idle : idle_) {
+      idle.clear();
+    }
+    auto sessions = std::move(sessions_);
+    sessions_.clear();
+    for (auto* session : sessions) {
+      session->setInfoCallback(nullptr);
+      session->closeWhenIdle();
+    }
+  }
+
+  void onDestroy(proxygen::HTTPSessionBase const& session) override {
+    auto* ptr = static_cast<proxygen::HTTPUpstreamSession const*>(&session);
+    sessions_.erase(const_cast<proxygen::HTTPUpstreamSession*>(ptr));
+    for (auto& idle : idle_) {
+      idle.erase(std::remove(idle.begin(), idle.end(), ptr), idle.end());
+    }
+  }
+
+private:
+  folly::EventBase* evb_;
+  std::shared_ptr<Cluster> cluster_;
+  proxygen::WheelTimerInstance timer_;
+  std::vector<std::vector<proxygen::HTTPUpstreamSession*>> idle_;
+  std::unordered_set<proxygen::HTTPUpstreamSession*> sessions_;
+  std::unique_ptr<HealthCheck> health_;
+  bool stopped_{false};
+};
+
+// Bridges one downstream request to one upstream transaction. The request body is held only
+// until the upstream transaction exists, with ingress paused meanwhile; after that bodies flow
+// straight through in both directions with flow control propagated across.
+class ProxyHandler final : public proxygen::RequestHandler,
+                           private proxygen::HTTPConnector::Callback {
+public:
+  explicit ProxyHandler(std::shared_ptr<Pool> pool) : pool_(std::move(pool)), client_(*this) {}
+
+  void onRequest(std::unique_ptr<proxygen::HTTPMessage> msg) noexcept override {
+    request_ = std::move(msg);
+    if (!pool_) {
+      // Pools belong to server IO threads, which App::dispatch() and batch sub-requests are not
+      // running on.
+      fail(503, "Service Unavailable", "Proxied routes are only served by the running server");
+      return;
+    }
+    pool_->cluster().deposit();
+    request_->stripPerHopHeaders();
+    auto const& client = request_->getClientIP();
+    auto const forwarded = request_->getHeaders().getSingleOrEmpty("X-Forwarded-For");
+    request_->getHeaders().set(
+        "X-Forwarded-For", forwarded.empty() ? client : forwarded + ", " + client
+    );
+    downstream_->pauseIngress();
+    connect();
+  }
+
+  void onBody(std::unique_ptr<folly::IOBuf> body) noexcept override {
+    if (failed_) {
+      return;
+    }
+    if (txn_) {
+      sent_body_ = true;
+      txn_->sendBody(std::move(body));
+    } else {
+      body_.append(std::move(body));
+    }
+  }
+
+  void onEOM() noexcept override {
+    if (failed_) {
+      return;
+    }
+    eom_ = true;
+    if (txn_) {
+      txn_->sendEOM();
+    }
+  }
+
+  void onUpgrade(proxygen::UpgradeProtocol) noexcept override {}
+
+  void requestComplete() noexcept override {
+    done_ = true;
+    finish();
+  }
+
+  void onError(proxygen::ProxygenError) noexcept override {
+    done_ = true;
+    if (connecting_) {
+      connector_->reset();
+      connecting_ = false;
+      uncount();
+    }
+    if (txn_) {
+      // detachTransaction() follows the abort and finishes up.
+      txn_->sendAbort();
+      return;
+    }
+    finish();
+  }
+
+  void onEgressPaused() noexcept override {
+    if (txn_) {
+      txn_->pauseIngress();
+    }
+  }
+
+  void onEgressResumed() noexcept override {
+    if (txn_) {
+      txn_->resumeIngress();
+    }
+  }
+
+private:
+  class Client final : public proxygen::HTTPTransactionHandler {
+  public:
+    explicit Client(ProxyHandler& parent) : parent_(parent) {}
+
+    void setTransaction(proxygen::HTTPTransaction*) noexcept override {}
+
+    void detachTransaction() noexcept override { parent_.onUpstreamDetach(); }
+
+    void onHeadersComplete(std::unique_ptr<proxygen::HTTPMessage> msg) noexcept override {
+      parent_.onUpstreamHeaders(std::move(msg));
+    }
+
+    void onBody(std::unique_ptr<folly::IOBuf> chain) noexcept override {
+      parent_.onUpstreamBody(std::move(chain));
+    }
+
+    void onTrailers(std::unique_ptr<proxygen::HTTPHeaders>) noexcept override {}
+
+    void onEOM() noexcept override { parent_.onUpstreamEOM(); }
+
+    void onUpgrade(proxygen::UpgradeProtocol) noexcept override {}
+
+    void onError(proxygen::HTTPException const&) noexcept override { parent_.onUpstreamError(); }
+
+    void onEgressPaused() noexcept override { parent_.downstream_->pauseIngress(); }
+
+    void onEgressResumed() noexcept override { parent_.downstream_->resumeIngress(); }
+
+  private:
+    ProxyHandler& parent_;
+  };
+
+  void connect(std::size_t exclude = Cluster::none) {
+    auto& cluster = pool_->cluster();
+    upstream_ = cluster.pick(exclude);
+    if (upstream_ == Cluster::none) {
+      fail(503, "Service Unavailable");
+      return;
+    }
+    cluster.at(upstream_).outstanding.fetch_add(1, std::memory_order_relaxed);
+    counted_ = true;
+    auto* session = pool_->acquire(upstream_);
+    reused_ = session != nullptr;
+    if (session) {
+      attach(session);
+      return;
+    }
+    open();
+  }
+
+  void open() {
+    if (!connector_) {
+      connector_ = std::make_unique<proxygen::HTTPConnector>(this, pool_->timer());
+    }
+    connecting_ = true;
+    auto& cluster = pool_->cluster();
+    connector_->connect(
+        pool_->evb(), cluster.at(upstream_).address, cluster.options().connect_timeout
+    );
+  }
+
+  void connectSuccess(proxygen::HTTPUpstreamSession* session) override {
+    connecting_ = false;
+    pool_->add(session);
+    attach(session);
+  }
+
+  void connectError(folly::AsyncSocketException const&) override {
+    connecting_ = false;
+    auto& cluster = pool_->cluster();
+    cluster.failed(upstream_);
+    uncount();
+    retry();
+  }
+
+  // Nothing has been sent upstream yet, so another upstream can take the request while it has
+  // attempts left and the budget allows.
+  void retry() {
+    auto& cluster = pool_->cluster();
+    if (attempts_ < cluster.options().retries && cluster.withdraw()) {
+      ++attempts_;
+      connect(upstream_);
+      return;
+    }
+    fail(502, "Bad Gateway");
+  }
+
+  void attach(proxygen::HTTPUpstreamSession* session) {
+    txn_ = session->newTransaction(&client_);
+    if (!txn_) {
+      // A session refusing transactions, such as one that is draining, says nothing about the
+      // upstream's health.
+      pool_->release(upstream_, session);
+      uncount();
+      retry();
+      return;
+    }
+    session_ = session;
+    txn_->sendHeaders(*request_);
+    if (!body_.empty()) {
+      sent_body_ = true;
+      txn_->sendBody(body_.move());
+    }
+    if (eom_) {
+      txn_->sendEOM();
+    }
+    downstream_->resumeIngress();
+  }
+
+  void onUpstreamHeaders(std::unique_ptr<proxygen::HTTPMessage> msg) {
+    if (done_) {
+      return;
+    }
+    responded_ = true;
+    msg->stripPerHopHeaders();
+    downstream_->sendHeaders(*msg);
+  }
+
+  void onUpstreamBody(std::unique_ptr<folly::IOBuf> chain) {
+    if (!done_) {
+      downstream_->sendBody(std::move(chain));
+    }
+  }
+
+  void onUpstreamEOM() {
+    pool_->cluster().succeeded(upstream_);
+    if (!done_) {
+      downstream_->sendEOM();
+    }
+  }
+
+  void onUpstreamError() {
+    if (done_) {
+      return;
+    }
+    // The upstream may have closed an idle keep-alive session just as it was reused. That says
+    // nothing about its health, and a request that can be sent again goes out on a new
+    // connection once this transaction detaches.
+    if (reused_ && !responded_ && !sent_body_ && detail::idempotent(*request_)) {
+      retry_ = true;
+      return;
+    }
+    pool_->cluster().failed(upstream_);
+    if (responded_) {
+      downstream_->sendAbort();
+    } else {
+      fail(502, "Bad Gateway");
+    }
+  }
+
+  void onUpstreamDetach() {
+    txn_ = nullptr;
+    if (session_) {
+      pool_->release(upstream_, session_);
+      session_ = nullptr;
+    }
+    if (retry_ && !done_) {
+      retry_ = false;
+      reused_ = false;
+      downstream_->pauseIngress();
+      open();
+      return;
+    }
+    uncount();
+    finish();
+  }
+
+  void fail(std::uint16_t code, std::string const& message, std::string const& body = {}) {
+    failed_ = true;
+    if (responded_) {
+      return;
+    }
+    responded_ = true;
+    if (pool_) {
+      downstream_->resumeIngress();
+    }
+    proxygen::ResponseBuilder(downstream_).status(code, message).body(body).sendWithEOM();
+  }
+
+  void uncount() {
+    if (counted_) {
+      pool_->cluster().at(upstream_).outstanding.fetch_sub(1, std::memory_order_relaxed);
+      counted_ = false;
+    }
+  }
+
+  void finish() {
+    if (done_ && !txn_ && !connecting_) {
+      delete this;
+    }
+  }
+
+  std::shared_ptr<Pool> pool_;
+  Client client_;
+  std::unique_ptr<proxygen::HTTPConnector> connector_;
+  std::unique_ptr<proxygen::HTTPMessage> request_;
+  folly::IOBufQueue body_{folly::IOBufQueue::cacheChainLength()};
+  proxygen::HTTPTransaction* txn_{nullptr};
+  proxygen::HTTPUpstreamSession* session_{nullptr};
+  std::size_t upstream_{Cluster::none};
+  std::size_t attempts_{0};
+  bool counted_{false};
+  bool connecting_{false};
+  bool reused_{false};
+  bool retry_{false};
+  bool sent_body_{false};
+  bool eom_{false};
+  bool responded_{false};
+  bool failed_{false};
+  bool done_{false};
+};
+
+class ProxyFactory final : public proxygen::RequestHandlerFactory {
+public:
+  explicit ProxyFactory(std::shared_ptr<Cluster> cluster) : cluster_(std::move(cluster)) {}
+
+  void onServerStart(folly::EventBase* evb) noexcept override {
+    *pool_ = std::make_shared<Pool>(evb, cluster_);
+  }
+
+  void onServerStop() noexcept override {
+    if (*pool_) {
+      (*pool_)->shutdown();
+      pool_->reset();
+    }
+  }
+
+  proxygen::RequestHandler* onRequest(
+      proxygen::RequestHandler*, proxygen::HTTPMessage*
+  ) noexcept override {
+    return new ProxyHandler(*pool_);
+  }
+
+private:
+  std::shared_ptr<Cluster> cluster_;
+  folly::ThreadLocal<std::shared_ptr<Pool>> pool_;
+};
+}  // namespace
+
+std::unique_ptr<proxygen::RequestHandlerFactory> proxy(
+    std::vector<std::string> upstreams, ProxyOptions options
+) {
+  return std::make_unique<ProxyFactory>(std::make_shared<Cluster>(upstreams, std::move(options)));
+}
+}  // namespace wrap
@@ -1,24 +1,40 @@
+#include <fmt/format.h>
+#include <folly/io/async/EventBaseManager.h>
 #include <gtest/gtest.h>
 #include <httplib.h>
+#include <netinet/in.h>
+#include <proxygen/httpserver/RequestHandler.h>
+#include <proxygen/httpserver/RequestHandlerFactory.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
+#include <atomic>
 #include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <future>
+#include <map>
 #include <memory>
 #include <thread>
 
 #include "wrap/app.h"
+#include "wrap/batch.h"
+#include "wrap/debug.h"
+#include "wrap/filter.h"
+#include "wrap/proxy.h"
 
 using namespace wrap;
 
 class WrapTest : public testing::Test {
 protected:
   static constexpr char const* host = "127.0.0.1";
-  static constexpr int port = 8081;
 
   void SetUp() override {
     app_ = std::make_unique<App>();
-    thread_ = std::thread([&] { app_->run(host, port); });
-    std::this_thread::sleep_for(std::chrono::seconds(1));
-    client_ = std::make_unique<httplib::Client>(host, port);
+    auto ready = app_->ready();
+    thread_ = std::thread([&] { app_->run(host, 0); });
+    auto const address = std::move(ready).get(std::chrono::seconds(10));
+    client_ = std::make_unique<httplib::Client>(host, address.getPort());
   }
 
   void TearDown() override {
@@ -39,3 +55,675 @@ TEST_F(WrapTest, GetTest) {
   EXPECT_EQ(res->status, 200);
   EXPECT_EQ(res->body, "TEST");
 }
+
+TEST(ReadyTest, RestartTest) {
+  App app;
+  for (int i = 0; i < 2; ++i) {
+    auto ready = app.ready();
+    std::thread thread([&] { app.run("127.0.0.1", 0); });
+    EXPECT_NE(std::move(ready).get(std::chrono::seconds(10)).getPort(), 0);
+    app.stop();
+    thread.join();
+  }
+}
+
+TEST(ReadyTest, BindErrorTest) {
+  App first;
+  auto ready = first.ready();
+  std::thread thread([&] { first.run("127.0.0.1", 0); });
+  auto const port = std::move(ready).get(std::chrono::seconds(10)).getPort();
+
+  App second;
+  auto failed = second.ready();
+  EXPECT_ANY_THROW(second.run("127.0.0.1", port));
+  EXPECT_ANY_THROW(std::move(failed).get(std::chrono::seconds(1)));
+
+  first.stop();
+  thread.join();
+}
+
+// Without WRAP_WITH_HTTP3 the listener cannot be built, and with it the certificate is missing.
+TEST(ReadyTest, Http3ErrorTest) {
+  App app({.host = "127.0.0.1", .port = 0, .http3_port = 0, .cert = "/nonexistent"});
+  auto failed = app.ready();
+  EXPECT_ANY_THROW(app.run());
+  EXPECT_ANY_THROW(std::move(failed).get(std::chrono::seconds(1)));
+}
+
+TEST(Http3Test, AltSvcTest) {
+#if !WRAP_HAS_HTTP3
+  GTEST_SKIP() << "Built without WRAP_WITH_HTTP3";
+#else
+  auto const dir = std::filesystem::temp_directory_path();
+  auto const cert = (dir / "wrap_test_cert.pem").string();
+  auto const key = (dir / "wrap_test_key.pem").string();
+  auto const command = fmt::format(
+      "openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost -keyout {} -out {}"
+      " >/dev/null 2>&1",
+      key, cert
+  );
+  if (std::system(command.c_str()) != 0) {
+    GTEST_SKIP() << "openssl is not available to make a certificate";
+  }
+
+  // Alt-Svc names a fixed port, so borrow a free one from the kernel.
+  auto const fd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  bind(fd, reinterpret_cast<sockaddr*>(&addr), len);
+  getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len);
+  close(fd);
+  auto const http3_port = ntohs(addr.sin_port);
+
+  App app({
+      .host = "127.0.0.1",
+      .port = 0,
+      .threads = 1,
+      .http3_port = http3_port,
+      .cert = cert,
+      .key = key,
+  });
+  app.get("/", []() { return "HELLO"; });
+  auto ready = app.ready();
+  std::thread thread([&] { app.run(); });
+  httplib::Client client("127.0.0.1", std::move(ready).get(std::chrono::seconds(10)).getPort());
+
+  auto const res = client.Get("/");
+  ASSERT_TRUE(res);
+  EXPECT_EQ(res->body, "HELLO");
+  EXPECT_EQ(res->get_header_value("Alt-Svc"), fmt::format("h3=\":{}\"; ma=86400", http3_port));
+
+  app.stop();
+  thread.join();
+  std::filesystem::remove(cert);
+  std::filesystem::remove(key);
+#endif
+}
+
+TEST(DispatchTest, GetTest) {
+  App app;
+  app.get("/users/{id:int}", [](int id) { return std::to_string(id); });
+
+  auto const res = app.dispatch(proxygen::HTTPMethod::GET, "/users/42");
+  EXPECT_EQ(res.status, 200);
+  EXPECT_EQ(res.body, "42");
+
+  auto const missing = app.dispatch(proxygen::HTTPMethod::GET, "/users/abc");
+  EXPECT_EQ(missing.status, 404);
+}
+
+TEST(DispatchTest, PostTest) {
+  App app;
+  app.post("/echo", [](Request const& req, Response& res) {
+    res.status(201, "Created").body(req.body());
+  });
+
+  auto const res = app.dispatch(proxygen::HTTPMethod::POST, "/echo", "TEST");
+  EXPECT_EQ(res.status, 201);
+  EXPECT_EQ(res.body, "TEST");
+}
+
+TEST(DispatchTest, FilterTest) {
+  App app;
+  app.use(filter::trace("test-"));
+  app.get("/", []() { return "TEST"; });
+
+  auto const res = app.dispatch(proxygen::HTTPMethod::GET, "/");
+  EXPECT_EQ(res.status, 200);
+  EXPECT_TRUE(res.headers.getSingleOrEmpty("X-Request-Id").starts_with("test-"));
+}
+
+TEST(DispatchTest, AltSvcTest) {
+  App app;
+  app.use(filter::alt_svc(4433));
+  app.get("/", []() { return "TEST"; });
+
+  auto const res = app.dispatch(proxygen::HTTPMethod::GET, "/");
+  EXPECT_EQ(res.headers.getSingleOrEmpty("Alt-Svc"), "h3=\":4433\"; ma=86400");
+}
+
+TEST(DispatchTest, ReplaceTest) {
+  App app;
+  app.get("/", []() { return "OLD"; });
+  app.replace(proxygen::HTTPMethod::GET, "/", [](Request const&, Response& res) {
+    detail::send_ok(res, "NEW");
+  });
+  EXPECT_EQ(app.dispatch(proxygen::HTTPMethod::GET, "/").body, "NEW");
+
+  EXPECT_TRUE(app.remove(proxygen::HTTPMethod::GET, "/"));
+  EXPECT_FALSE(app.remove(proxygen::HTTPMethod::GET, "/"));
+  EXPECT_EQ(app.dispatch(proxygen::HTTPMethod::GET, "/").status, 404);
+}
+
+// Accepts every request and never responds.
+class SilentFactory final : public proxygen::RequestHandlerFactory {
+public:
+  class Handler final : public proxygen::RequestHandler {
+  public:
+    void onRequest(std::unique_ptr<proxygen::HTTPMessage>) noexcept override {}
+    void onBody(std::unique_ptr<folly::IOBuf>) noexcept override {}
+    void onEOM() noexcept override {}
+    void onUpgrade(proxygen::UpgradeProtocol) noexcept override {}
+    void requestComplete() noexcept override { delete this; }
+    void onError(proxygen::ProxygenError) noexcept override { delete this; }
+  };
+
+  void onServerStart(folly::EventBase*) noexcept override {}
+  void onServerStop() noexcept override {}
+
+  proxygen::RequestHandler* onRequest(
+      proxygen::RequestHandler*, proxygen::HTTPMessage*
+  ) noexcept override {
+    return new Handler();
+  }
+};
+
+TEST(DispatchTest, TimeoutTest) {
+  App app({.dispatch_timeout = std::chrono::milliseconds(50)});
+  app.mount("/silent", std::make_unique<SilentFactory>());
+  EXPECT_EQ(app.dispatch(proxygen::HTTPMethod::GET, "/silent").status, 504);
+}
+
+TEST(BatchTest, DispatchTest) {
+  App app;
+  app.get("/users/{id:int}", [](int id) { return std::to_string(id); });
+  app.mount("/batch", batch(app, {.concurrency = 2}));
+
+  auto const res = app.dispatch(
+      proxygen::HTTPMethod::POST, "/batch",
+      R"([{"url":"/users/1"},{"method":"GET","url":"/users/2"},{"url":"/missing"},{"method":"POST","url":"/batch","body":[]}])"
+  );
+  ASSERT_EQ(res.status, 200);
+  auto const out = folly::parseJson(res.body);
+  ASSERT_EQ(out.size(), 4);
+  EXPECT_EQ(out[0]["status"].asInt(), 200);
+  EXPECT_EQ(out[0]["body"].asString(), "1");
+  EXPECT_EQ(out[1]["body"].asString(), "2");
+  EXPECT_EQ(out[2]["status"].asInt(), 404);
+  EXPECT_EQ(out[3]["status"].asInt(), 400);
+}
+
+TEST(BatchTest, NonBlockingTest) {
+  App app({.threads = 1});
+  app.get("/slow", []() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    return "SLOW";
+  });
+  app.get("/fast", []() { return "FAST"; });
+  app.mount("/batch", batch(app));
+  auto ready = app.ready();
+  std::thread thread([&] { app.run("127.0.0.1", 0); });
+  auto const port = std::move(ready).get(std::chrono::seconds(10)).getPort();
+
+  auto pending = std::async(std::launch::async, [port] {
+    httplib::Client client("127.0.0.1", port);
+    return client.Post("/batch", R"([{"url":"/slow"}])", "application/json");
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  // The only IO thread stays free while the batch waits on its sub-request.
+  httplib::Client client("127.0.0.1", port);
+  auto const start = std::chrono::steady_clock::now();
+  auto const fast = client.Get("/fast");
+  ASSERT_TRUE(fast);
+  EXPECT_EQ(fast->body, "FAST");
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(300));
+
+  auto const slow = pending.get();
+  ASSERT_TRUE(slow);
+  EXPECT_EQ(slow->status, 200);
+  EXPECT_EQ(folly::parseJson(slow->body)[0]["body"].asString(), "SLOW");
+
+  app.stop();
+  thread.join();
+}
+
+TEST(ParamsTest, QueryTest) {
+  App app;
+  app.get("/search", [](Request const& req, Response& res) {
+    auto const& query = req.getQuery();
+    res.status(200, "OK").body(fmt::format(
+        "{}|{}|{}", query.find("q").value_or(""), query.all("tag").size(),
+        query.get<int>("limit").value_or(-1)
+    ));
+  });
+
+  auto const res =
+      app.dispatch(proxygen::HTTPMethod::GET, "/search?q=a+b%21&tag=x&tag=y&limit=5");
+  EXPECT_EQ(res.body, "a b!|2|5");
+}
+
+TEST(ParamsTest, FormTest) {
+  App app;
+  app.post("/login", [](Request const& req, Response& res) {
+    res.status(200, "OK").body(std::string(req.getForm().find("user").value_or("")));
+  });
+
+  auto msg = std::make_unique<proxygen::HTTPMessage>();
+  msg->setMethod(proxygen::HTTPMethod::POST);
+  msg->setURL("/login");
+  msg->getHeaders().set("Content-Type", "application/x-www-form-urlencoded");
+  auto const res = app.dispatch(std::move(msg), folly::IOBuf::copyBuffer("user=jo%20e&pass=x"));
+  EXPECT_EQ(res.body, "jo e");
+}
+
+TEST(ParamsTest, InjectTest) {
+  App app;
+  app.get("/items", [](Query<"limit", int> limit, Query<"q", std::optional<std::string>> q) {
+    return fmt::format("{}:{}", *limit, q->value_or("none"));
+  });
+
+  EXPECT_EQ(app.dispatch(proxygen::HTTPMethod::GET, "/items?limit=3").body, "3:none");
+  EXPECT_EQ(app.dispatch(proxygen::HTTPMethod::GET, "/items?limit=3&q=x").body, "3:x");
+  EXPECT_EQ(app.dispatch(proxygen::HTTPMethod::GET, "/items?limit=x").status, 400);
+}
+
+TEST(ParamsTest, MixedTest) {
+  App app;
+  app.get("/users/{id}", [](int id, Query<"q"> q) noexcept {
+    return fmt::format("{}:{}", id, *q);
+  });
+  app.post("/users/{id}", [](int id, Query<"role"> role) {
+    return fmt::format("{}:{}", id, *role);
+  });
+
+  EXPECT_EQ(app.dispatch(proxygen::HTTPMethod::GET, "/users/7?q=x").body, "7:x");
+  EXPECT_EQ(app.dispatch(proxygen::HTTPMethod::GET, "/users/abc?q=x").status, 404);
+  EXPECT_EQ(app.dispatch(proxygen::HTTPMethod::GET, "/users/7").status, 400);
+  EXPECT_EQ(app.dispatch(proxygen::HTTPMethod::POST, "/users/7?role=admin").body, "7:admin");
+}
+
+TEST(DebugTest, HeapTest) {
+  App app;
+  debug::install(app, {.token = "secret"});
+
+  EXPECT_EQ(app.dispatch(proxygen::HTTPMethod::GET, "/debug/pprof/heap").status, 403);
+
+  auto msg = std::make_unique<proxygen::HTTPMessage>();
+  msg->setMethod(proxygen::HTTPMethod::GET);
+  msg->setURL("/debug/pprof/heap");
+  msg->setClientAddress(folly::SocketAddress("127.0.0.1", 0));
+  msg->getHeaders().set("Authorization", "Bearer secret");
+  auto const res = app.dispatch(std::move(msg));
+  EXPECT_EQ(res.status, 200);
+  EXPECT_TRUE(folly::parseJson(res.body).count("allocator"));
+}
+
+TEST(DebugTest, ProfileTest) {
+  App app;
+  debug::install(app);
+
+  auto const res = app.dispatch(proxygen::HTTPMethod::GET, "/debug/pprof/profile?seconds=1");
+  EXPECT_EQ(res.status, 200);
+  EXPECT_EQ(res.headers.getSingleOrEmpty("Content-Type"), "text/plain; charset=utf-8");
+}
+
+TEST(DebugTest, LoopsTest) {
+  App app({.threads = 2});
+  debug::install(app);
+  auto ready = app.ready();
+  std::thread thread([&] { app.run("127.0.0.1", 0); });
+  auto const port = std::move(ready).get(std::chrono::seconds(10)).getPort();
+
+  // Concurrent requests on different IO threads each get the other's loop probed too.
+  auto get = [port] {
+    httplib::Client client("127.0.0.1", port);
+    auto const res = client.Get("/debug/loops");
+    return res ? folly::parseJson(res->body) : folly::dynamic();
+  };
+  auto first = std::async(std::launch::async, get);
+  auto second = std::async(std::launch::async, get);
+  for (auto const& loops : {first.get(), second.get()}) {
+    ASSERT_TRUE(loops.isArray());
+    EXPECT_EQ(loops.size(), 2u);
+    for (auto const& loop : loops) {
+      EXPECT_TRUE(loop["lag_us"].isInt());
+    }
+  }
+
+  app.stop();
+  thread.join();
+}
+
+TEST(ProxyTest, ForwardTest) {
+  App upstream;
+  upstream.get("/api/hello", []() { return "HELLO"; });
+  upstream.post("/api/echo", [](Request const& req, Response& res) {
+    res.status(200, "OK").body(req.getHeader("X-Forwarded-For") + " " + req.body());
+  });
+  auto upstream_ready = upstream.ready();
+  std::thread upstream_thread([&] { upstream.run("127.0.0.1", 0); });
+  auto const upstream_port = std::move(upstream_ready).get(std::chrono::seconds(10)).getPort();
+
+  App app;
+  app.mount("/api", proxy({fmt::format("127.0.0.1:{}", upstream_port)}));
+  app.get("/", []() { return "LOCAL"; });
+  auto ready = app.ready();
+  std::thread thread([&] { app.run("127.0.0.1", 0); });
+  httplib::Client client("127.0.0.1", std::move(ready).get(std::chrono::seconds(10)).getPort());
+
+  for (int i = 0; i < 3; ++i) {
+    auto const res = client.Get("/api/hello");
+    ASSERT_TRUE(res);
+    EXPECT_EQ(res->status, 200);
+    EXPECT_EQ(res->body, "HELLO");
+  }
+  auto const echo = client.Post("/api/echo", "DATA", "text/plain");
+  ASSERT_TRUE(echo);
+  EXPECT_EQ(echo->body, "127.0.0.1 DATA");
+  EXPECT_EQ(client.Get("/")->body, "LOCAL");
+
+  app.stop();
+  thread.join();
+  upstream.stop();
+  upstream_thread.join();
+}
+
+TEST(ProxyTest, UnavailableTest) {
+  App app;
+  app.mount("/api", proxy({"127.0.0.1:1"}, {.retries = 0}));
+  auto ready = app.ready();
+  std::thread thread([&] { app.run("127.0.0.1", 0); });
+  httplib::Client client("127.0.0.1", std::move(ready).get(std::chrono::seconds(10)).getPort());
+
+  auto const res = client.Get("/api/hello");
+  ASSERT_TRUE(res);
+  EXPECT_EQ(res->status, 502);
+
+  app.stop();
+  thread.join();
+}
+
+// Answers the first request on each connection and closes it on the next, like an upstream
+// whose keep-alive timeout expires as the proxy reuses the connection.
+class ClosingUpstream {
+public:
+  ClosingUpstream() {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    bind(fd_, reinterpret_cast<sockaddr*>(&addr), len);
+    listen(fd_, 16);
+    getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &len);
+    port_ = ntohs(addr.sin_port);
+    thread_ = std::thread([this] {
+      for (int conn; (conn = accept(fd_, nullptr, nullptr)) >= 0;) {
+        std::thread([conn] {
+          char buf[4096];
+          if (read(conn, buf, sizeof(buf)) > 0) {
+            std::string_view const res = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nHELLO";
+            write(conn, res.data(), res.size());
+            read(conn, buf, sizeof(buf));
+          }
+          close(conn);
+        }).detach();
+      }
+    });
+  }
+
+  ~ClosingUpstream() {
+    shutdown(fd_, SHUT_RDWR);
+    close(fd_);
+    thread_.join();
+  }
+
+  std::uint16_t port() const { return port_; }
+
+private:
+  int fd_;
+  std::uint16_t port_;
+  std::thread thread_;
+};
+
+TEST(ProxyTest, StaleConnectionTest) {
+  ClosingUpstream upstream;
+  // One IO thread, so every request after the first reuses the pooled connection.
+  App app({.threads = 1});
+  app.mount(
+      "/api",
+      proxy({fmt::format("127.0.0.1:{}", upstream.port())}, {.health_interval = {}, .retries = 0})
+  );
+  auto ready = app.ready();
+  std::thread thread([&] { app.run("127.0.0.1", 0); });
+  httplib::Client client("127.0.0.1", std::move(ready).get(std::chrono::seconds(10)).getPort());
+
+  for (int i = 0; i < 3; ++i) {
+    auto const res = client.Get("/api/hello");
+    ASSERT_TRUE(res);
+    EXPECT_EQ(res->status, 200);
+    EXPECT_EQ(res->body, "HELLO");
+  }
+
+  app.stop();
+  thread.join();
+}
+
+// Upstream App that answers with its name, after half a second for /api/slow.
+class NamedUpstream {
+public:
+  explicit NamedUpstream(std::string const& name, std::uint16_t port = 0) {
+    app_.get("/api/name", [name]() { return name; });
+    app_.get("/api/slow", [name]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(500));
+      return name;
+    });
+    auto ready = app_.ready();
+    thread_ = std::thread([this, port] { app_.run("127.0.0.1", port); });
+    port_ = std::move(ready).get(std::chrono::seconds(10)).getPort();
+  }
+
+  ~NamedUpstream() {
+    app_.stop();
+    thread_.join();
+  }
+
+  std::uint16_t port() const { return port_; }
+
+  std::string address() const { return fmt::format("127.0.0.1:{}", port_); }
+
+private:
+  App app_;
+  std::thread thread_;
+  std::uint16_t port_;
+};
+
+// Proxy on one IO thread whose get() returns the upstream's body, or the status on errors.
+class ProxyFront {
+public:
+  ProxyFront(std::vector<std::string> upstreams, ProxyOptions options) : app_({.threads = 1}) {
+    app_.mount("/api", proxy(std::move(upstreams), options));
+    auto ready = app_.ready();
+    thread_ = std::thread([this] { app_.run("127.0.0.1", 0); });
+    port_ = std::move(ready).get(std::chrono::seconds(10)).getPort();
+  }
+
+  ~ProxyFront() {
+    app_.stop();
+    thread_.join();
+  }
+
+  std::string get(std::string const& path = "/api/name") const {
+    httplib::Client client("127.0.0.1", port_);
+    auto const res = client.Get(path);
+    if (!res) {
+      return "error";
+    }
+    return res->status == 200 ? res->body : std::to_string(res->status);
+  }
+
+private:
+  App app_;
+  std::thread thread_;
+  std::uint16_t port_;
+};
+
+TEST(ProxyTest, RoundRobinTest) {
+  NamedUpstream a("A");
+  NamedUpstream b("B");
+  ProxyFront front(
+      {a.address(), b.address()},
+      {.balance = LoadBalance::round_robin, .health_interval = {}}
+  );
+
+  std::vector<std::string> names;
+  for (int i = 0; i < 6; ++i) {
+    names.push_back(front.get());
+  }
+  EXPECT_EQ(names, (std::vector<std::string>{"A", "B", "A", "B", "A", "B"}));
+}
+
+TEST(ProxyTest, LeastOutstandingTest) {
+  NamedUpstream a("A");
+  NamedUpstream b("B");
+  ProxyFront front(
+      {a.address(), b.address()},
+      {.balance = LoadBalance::least_outstanding, .health_interval = {}}
+  );
+
+  // Ties go to the first upstream, which is then busy when the next request arrives.
+  auto slow = std::async(std::launch::async, [&] { return front.get("/api/slow"); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  EXPECT_EQ(front.get(), "B");
+  EXPECT_EQ(slow.get(), "A");
+  EXPECT_EQ(front.get(), "A");
+}
+
+TEST(ProxyTest, P2cTest) {
+  NamedUpstream a("A");
+  NamedUpstream b("B");
+  ProxyFront front(
+      {a.address(), b.address()}, {.balance = LoadBalance::p2c, .health_interval = {}}
+  );
+
+  // With nothing outstanding, either of the two random choices may win.
+  std::map<std::string, int> counts;
+  for (int i = 0; i < 40; ++i) {
+    ++counts[front.get()];
+  }
+  EXPECT_EQ(counts.size(), 2u);
+  EXPECT_GT(counts["A"], 0);
+  EXPECT_GT(counts["B"], 0);
+}
+
+TEST(ProxyTest, EjectionTest) {
+  NamedUpstream a("A");
+  ProxyFront front(
+      {"127.0.0.1:1", a.address()},
+      {.balance = LoadBalance::round_robin,
+       .max_failures = 1,
+       .ejection = std::chrono::seconds(60),
+       .health_interval = {},
+       .retries = 0}
+  );
+
+  // Round robin would alternate; once the dead upstream fails it is skipped.
+  EXPECT_EQ(front.get(), "502");
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(front.get(), "A");
+  }
+}
+
+TEST(ProxyTest, RecoveryTest) {
+  auto const port = NamedUpstream("B").port();
+  NamedUpstream a("A");
+  ProxyFront front(
+      {fmt::format("127.0.0.1:{}", port), a.address()},
+      {.balance = LoadBalance::round_robin,
+       .max_failures = 1,
+       .ejection = std::chrono::seconds(60),
+       .health_interval = std::chrono::milliseconds(100),
+       .retries = 0}
+  );
+
+  // Probes eject the stopped upstream well before its own ejection would end.
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(front.get(), "A");
+  }
+  NamedUpstream b("B", port);
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  std::map<std::string, int> counts;
+  for (int i = 0; i < 4; ++i) {
+    ++counts[front.get()];
+  }
+  EXPECT_EQ(counts["A"], 2);
+  EXPECT_EQ(counts["B"], 2);
+}
+
+TEST(ProxyTest, RetryBudgetTest) {
+  NamedUpstream a("A");
+  ProxyFront front(
+      {"127.0.0.1:1", a.address()},
+      {.balance = LoadBalance::round_robin,
+       .max_failures = 100,
+       .health_interval = {},
+       .retries = 1,
+       .retry_ratio = 0,
+       .retry_burst = 1}
+  );
+
+  // The one retry in the budget moves the first request to the live upstream. Nothing refills
+  // it, so the next request that lands on the dead upstream fails.
+  EXPECT_EQ(front.get(), "A");
+  EXPECT_EQ(front.get(), "502");
+}
+
+TEST(ProxyTest, DispatchTest) {
+  App app;
+  app.mount("/api", proxy({"127.0.0.1:1"}));
+  EXPECT_EQ(app.dispatch(proxygen::HTTPMethod::GET, "/api/hello").status, 503);
+}
+
+TEST(StateTest, DispatchTest) {
+  struct Counter {
+    int count{0};
+  };
+
+  App app;
+  app.state<Counter>();
+  app.get("/count", [](Request const& req, Response& res) {
+    auto* counter = req.state<Counter>();
+    detail::send_ok(res, counter ? std::to_string(++counter->count) : "NONE");
+  });
+
+  // Only the server's IO threads have state; nothing would destroy one made for this thread.
+  EXPECT_EQ(app.dispatch(proxygen::HTTPMethod::GET, "/count").body, "NONE");
+}
+
+TEST(StateTest, ServerTest) {
+  static std::atomic<int> created{0};
+  static std::atomic<int> destroyed{0};
+  struct Loop {
+    explicit Loop(folly::EventBase* evb) : evb(evb) { ++created; }
+    ~Loop() { ++destroyed; }
+    folly::EventBase* evb;
+  };
+
+  App app({.threads = 2});
+  app.state<Loop>([](folly::EventBase* evb) { return std::make_unique<Loop>(evb); });
+  app.get("/loop", [](Request const& req, Response& res) {
+    auto const* loop = req.state<Loop>();
+    bool const own = loop && loop->evb == folly::EventBaseManager::get()->getEventBase();
+    detail::send_ok(res, own ? "OK" : "WRONG");
+  });
+  auto ready = app.ready();
+  std::thread thread([&] { app.run("127.0.0.1", 0); });
+  httplib::Client client("127.0.0.1", std::move(ready).get(std::chrono::seconds(10)).getPort());
+
+  // One per IO thread, made with its event base when the server starts.
+  EXPECT_EQ(created, 2);
+  for (int i = 0; i < 4; ++i) {
+    auto const res = client.Get("/loop");
+    ASSERT_TRUE(res);
+    EXPECT_EQ(res->body, "OK");
+  }
+  EXPECT_EQ(created, 2);
+
+  app.stop();
+  thread.join();
+  EXPECT_EQ(destroyed, 2);
+}